@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <strings.h> // For strcasecmp
 #include <sys/stat.h>
 #include <errno.h>
 
@@ -14,6 +15,7 @@
 #include "drivers/sdcard.h"
 #include "drivers/fat32.h"
 #include "drivers/lcd.h"
+#include "drivers/wav.h"
 #include "songs.h"
 #include "tests.h"
 #include "commands.h"
@@ -37,7 +39,7 @@ static const command_t commands[] = {
     {"mkfile", sd_mkfile, "Create a new file"},
     {"mv", sd_mv, "Move or rename a file/directory"},
     {"more", sd_more, "Page through a file"},
-    {"play", play, "Play a song"},
+    {"play", play, "Play a song or WAV file"},
     {"poweroff", power_off, "Power off the device"},
     {"pwd", sd_pwd, "Print working directory"},
     {"reset", reset, "Reset the device"},
@@ -109,9 +111,69 @@ char *basename(const char *path)
     return (char *)path; // No slashes, return the whole path
 }
 
+// Stream a WAV file from the SD card
+static void play_wav_file(const char *filename)
+{
+    wav_format_t format;
+    wav_error_t result = wav_open(filename, &format);
+    if (result == WAV_OK)
+    {
+        result = wav_start();
+    }
+    if (result != WAV_OK)
+    {
+        printf("Cannot play '%s':\n%s\n", filename, wav_error_string(result));
+        wav_close();
+        return;
+    }
+
+    printf("\nNow playing:\n%s\n", basename(filename));
+    printf("%lu Hz, %u-bit, %s, %lu.%lus\n\n",
+           format.sample_rate, format.bits_per_sample,
+           format.channels == 2 ? "stereo" : "mono",
+           format.frames / format.sample_rate, format.frames % format.sample_rate * 10 / format.sample_rate);
+    printf("Press BREAK key to stop...\n");
+
+    // Reset user interrupt flag
+    user_interrupt = false;
+
+    // Keep the read-ahead ring filled until the audio has taken the last of it
+    while (wav_is_playing() && !user_interrupt)
+    {
+        wav_service();
+        __wfe();
+    }
+
+    wav_stats_t stats;
+    wav_get_stats(&stats);
+    wav_close();
+
+    if (user_interrupt)
+    {
+        printf("\nPlayback interrupted by user.\n");
+    }
+    else
+    {
+        printf("\nWAV finished!\n");
+    }
+
+    uint32_t needed = format.sample_rate * format.channels * format.bits_per_sample / 8;
+    uint32_t achieved = stats.read_us > 0 ? (uint64_t)stats.bytes_read * 1000000 / stats.read_us : 0;
+    printf("Underruns: %lu frames\n", stats.underruns);
+    printf("Buffers full: min %u, avg %u of %u\n", stats.min_fill, stats.average_fill, WAV_BUFFER_COUNT);
+    printf("Card: %lu KB/s (need %lu), max %lu us\n", achieved / 1024, needed / 1024, stats.max_read_us);
+}
+
 // Extended song command that takes a parameter
 static void play_named_song(const char *song_name)
 {
+    size_t length = strlen(song_name);
+    if (length > 4 && strcasecmp(song_name + length - 4, ".wav") == 0)
+    {
+        play_wav_file(song_name);
+        return;
+    }
+
     const audio_song_t *song = find_song(song_name);
     if (!song)
     {
@@ -428,7 +490,7 @@ void clearscreen()
 void play()
 {
     printf("Error: No song specified.\n");
-    printf("Usage: play <name>\n");
+    printf("Usage: play <name> or play <file.wav>\n");
     printf("Use 'songs' command to see available\nsongs.\n");
 }
 
@@ -459,12 +521,12 @@ void width_set(const char *width)
     if (strcmp(width, "40") == 0)
     {
         columns = 40;
-        lcd_set_font(&font_8x10);
+        printf("\033[?4264l"); // redraws the screen in the 8x10 font
     }
     else if (strcmp(width, "64") == 0)
     {
         columns = 64;
-        lcd_set_font(&font_5x10);
+        printf("\033[?4264h"); // redraws the screen in the 5x10 font
     }
     else
     {
@@ -587,6 +649,9 @@ void sd_status()
     printf("  Type: %s\n", is_sdhc ? "SDHC" : "SDSC");
     get_str_size(buffer, sizeof(buffer), fat32_get_cluster_size());
     printf("  Cluster size: %s\n", buffer);
+    uint32_t hits, misses;
+    fat32_get_fat_cache_stats(&hits, &misses);
+    printf("  FAT cache: %lu hits, %lu misses\n", hits, misses);
 }
 
 void sd_free()
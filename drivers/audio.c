@@ -6,9 +6,15 @@
 //  each controlled by separate PIO state machines for independent frequency
 //  generation, enabling true stereo audio output.
 //
+//  Sampled audio is played with the PWM slice that drives both pins, fed by
+//  DMA from a pair of buffers, so no time is spent on each sample.
+//
 
 #include "pico/stdlib.h"
 #include "hardware/pio.h"
+#include "hardware/pwm.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
 #include "hardware/clocks.h"
 #include "pico/time.h"
 
@@ -39,6 +45,9 @@ void audio_play_sound_blocking(uint32_t left_frequency, uint32_t right_frequency
         return;
     }
 
+    audio_song_stop(); // a tone replaces the song, which would change it at its next note
+    audio_pcm_stop(); // the pins can only play one or the other
+
     // Cancel any existing tone alarm
     if (tone_alarm_id >= 0)
     {
@@ -77,6 +86,9 @@ void audio_play_sound(uint32_t left_frequency, uint32_t right_frequency)
         return;
     }
 
+    audio_song_stop(); // a tone replaces the song, which would change it at its next note
+    audio_pcm_stop(); // the pins can only play one or the other
+
     // Cancel any existing tone alarm
     if (tone_alarm_id >= 0)
     {
@@ -114,44 +126,490 @@ bool audio_is_playing(void)
     return is_playing;
 }
 
-// Function to play a stereo song from the stereo song array
-void audio_play_song_blocking(const audio_song_t *song)
+//
+//  Song sequencer
+//
+//  Songs are played in the background by an alarm that starts each note as the one before
+//  ends, with a short gap after each note that is not silence. A song can be paused,
+//  resumed, moved to a position or stopped, and the next song can be queued to start when
+//  the current song ends. The song callback is called, from the alarm, when a song ends by
+//  itself.
+//
+
+static const audio_song_t *song_current = NULL; // song playing or paused
+static const audio_song_t *song_next = NULL;    // song queued to play next
+static uint32_t song_note = 0;                  // index of the note playing
+static bool song_in_gap = false;                // in the gap after the note
+static bool song_paused = false;                // the song is paused
+static uint32_t song_remaining_ms = 0;          // time left in the note or gap when paused
+static absolute_time_t song_step_time;          // when the note or gap ends
+static alarm_id_t song_alarm_id = -1;
+static audio_song_callback_t song_callback = NULL;
+
+static int64_t song_step_callback(alarm_id_t id, void *user_data);
+
+static void song_silence(void)
+{
+    set_pwm_frequency(LEFT_CHANNEL, SILENCE);
+    set_pwm_frequency(RIGHT_CHANNEL, SILENCE);
+    is_playing = false;
+}
+
+static void song_cancel_step(void)
+{
+    if (song_alarm_id > 0)
+    {
+        cancel_alarm(song_alarm_id);
+    }
+    song_alarm_id = -1;
+}
+
+// Take the next step of the song after a delay
+static void song_schedule(uint32_t delay_ms)
+{
+    song_step_time = make_timeout_time_ms(delay_ms);
+    song_alarm_id = -1;
+
+    // An alarm that is already due is called straight away and schedules the step after it
+    alarm_id_t id = add_alarm_at(song_step_time, song_step_callback, NULL, true);
+    if (id > 0)
+    {
+        song_alarm_id = id;
+    }
+}
+
+// Play the current note for the time left in it
+static void song_play_note(uint32_t duration_ms)
+{
+    const audio_note_t *note = &song_current->notes[song_note];
+
+    song_in_gap = false;
+    set_pwm_frequency(LEFT_CHANNEL, note->left_frequency);
+    set_pwm_frequency(RIGHT_CHANNEL, note->right_frequency);
+    song_schedule(duration_ms);
+}
+
+// Play the current note, or move on to the queued song at the end of the song
+static void song_start_note(void)
+{
+    const audio_song_t *finished = NULL;
+
+    if (song_current->notes[song_note].duration_ms == 0)
+    {
+        finished = song_current;
+        song_current = song_next;
+        song_next = NULL;
+        song_note = 0;
+    }
+
+    if (song_current && song_current->notes[song_note].duration_ms != 0)
+    {
+        song_play_note(song_current->notes[song_note].duration_ms);
+    }
+    else
+    {
+        song_current = NULL;
+        song_silence();
+    }
+
+    if (finished && song_callback)
+    {
+        song_callback(finished);
+    }
+}
+
+static int64_t song_step_callback(alarm_id_t id, void *user_data)
+{
+    song_alarm_id = -1;
+    if (!song_current || song_paused)
+    {
+        return 0;
+    }
+
+    const audio_note_t *note = &song_current->notes[song_note];
+    if (!song_in_gap && (note->left_frequency != SILENCE || note->right_frequency != SILENCE))
+    {
+        // Small gap between notes for clarity (except for silence notes)
+        song_in_gap = true;
+        song_silence();
+        song_schedule(AUDIO_NOTE_GAP_MS);
+        return 0;
+    }
+
+    song_note++;
+    song_start_note();
+    return 0; // the next step has its own alarm
+}
+
+// Play a song in the background, replacing the song playing
+void audio_song_play(const audio_song_t *song)
+{
+    if (!audio_initialised || !song)
+    {
+        return;
+    }
+
+    audio_pcm_stop(); // the pins can only play one or the other
+
+    uint32_t state = save_and_disable_interrupts();
+    song_cancel_step();
+    song_current = song;
+    song_note = 0;
+    song_paused = false;
+    song_start_note();
+    restore_interrupts(state);
+}
+
+// Play a song when the song playing ends, or now if no song is playing
+void audio_song_queue(const audio_song_t *song)
 {
     if (!audio_initialised || !song)
     {
         return;
     }
 
-    int note_index = 0;
-    audio_note_t* notes = (audio_note_t*)song->notes;
-    while (notes[note_index].duration_ms != 0)
+    uint32_t state = save_and_disable_interrupts();
+    if (song_current)
+    {
+        song_next = song;
+    }
+    else
     {
-        audio_play_sound_blocking(
-            notes[note_index].left_frequency,
-            notes[note_index].right_frequency,
-            notes[note_index].duration_ms);
+        audio_song_play(song);
+    }
+    restore_interrupts(state);
+}
 
-        // Small gap between notes for clarity (except for silence notes)
-        if (notes[note_index].left_frequency != SILENCE ||
-            notes[note_index].right_frequency != SILENCE)
+// Pause the song, keeping its position
+void audio_song_pause(void)
+{
+    uint32_t state = save_and_disable_interrupts();
+    if (song_current && !song_paused)
+    {
+        song_cancel_step();
+        int64_t remaining_us = absolute_time_diff_us(get_absolute_time(), song_step_time);
+        song_remaining_ms = remaining_us > 0 ? (remaining_us + 999) / 1000 : 0;
+        song_paused = true;
+        song_silence();
+    }
+    restore_interrupts(state);
+}
+
+// Resume a paused song
+void audio_song_resume(void)
+{
+    uint32_t state = save_and_disable_interrupts();
+    if (song_current && song_paused)
+    {
+        song_paused = false;
+        if (song_in_gap)
+        {
+            song_schedule(song_remaining_ms);
+        }
+        else
         {
-            sleep_ms(20);
+            song_play_note(song_remaining_ms);
         }
+    }
+    restore_interrupts(state);
+}
+
+// Stop the song and forget the queued song
+void audio_song_stop(void)
+{
+    uint32_t state = save_and_disable_interrupts();
+    song_cancel_step();
+    song_current = NULL;
+    song_next = NULL;
+    song_paused = false;
+    restore_interrupts(state);
+
+    audio_stop();
+}
 
-        note_index++;
+// Move the song to a position, in milliseconds from the start (not counting the gaps)
+void audio_song_seek(uint32_t position_ms)
+{
+    uint32_t state = save_and_disable_interrupts();
+    if (song_current)
+    {
+        const audio_note_t *notes = song_current->notes;
+        uint32_t note = 0;
+        while (notes[note].duration_ms != 0 && position_ms >= notes[note].duration_ms)
+        {
+            position_ms -= notes[note].duration_ms;
+            note++;
+        }
 
-        // Check for user interrupt (BREAK key)
-        extern volatile bool user_interrupt;
-        if (user_interrupt)
+        song_cancel_step();
+        song_note = note;
+        song_in_gap = false;
+        if (notes[note].duration_ms == 0)
+        {
+            song_paused = false;
+            song_start_note(); // past the end
+        }
+        else if (song_paused)
+        {
+            song_remaining_ms = notes[note].duration_ms - position_ms;
+        }
+        else
+        {
+            song_play_note(notes[note].duration_ms - position_ms);
+        }
+    }
+    restore_interrupts(state);
+}
+
+// Get the position in the song, in milliseconds from the start (not counting the gaps)
+uint32_t audio_song_position(void)
+{
+    uint32_t position_ms = 0;
+
+    uint32_t state = save_and_disable_interrupts();
+    if (song_current)
+    {
+        const audio_note_t *notes = song_current->notes;
+        for (uint32_t note = 0; note < song_note; note++)
+        {
+            position_ms += notes[note].duration_ms;
+        }
+
+        if (!song_in_gap)
+        {
+            int64_t remaining_us = song_paused ? song_remaining_ms * 1000
+                                               : absolute_time_diff_us(get_absolute_time(), song_step_time);
+            int64_t played_us = (int64_t)notes[song_note].duration_ms * 1000 - MAX(remaining_us, 0);
+            position_ms += MAX(played_us, 0) / 1000;
+        }
+        else
+        {
+            position_ms += notes[song_note].duration_ms;
+        }
+    }
+    restore_interrupts(state);
+
+    return position_ms;
+}
+
+// Check if a song is playing (and not paused)
+bool audio_song_is_playing(void)
+{
+    return song_current != NULL && !song_paused;
+}
+
+// Set the callback that is called when a song ends by itself
+void audio_set_song_callback(audio_song_callback_t callback)
+{
+    song_callback = callback;
+}
+
+// Play a song, waiting for it to end or for the BREAK key
+void audio_play_song_blocking(const audio_song_t *song)
+{
+    extern volatile bool user_interrupt;
+
+    if (!audio_initialised || !song)
+    {
+        return;
+    }
+
+    audio_song_play(song);
+    while (audio_song_is_playing() && !user_interrupt)
+    {
+        __wfe(); // woken by the alarms and the keyboard
+    }
+
+    audio_song_stop(); // Ensure audio is stopped at the end
+}
+
+
+//
+//  Sampled audio
+//
+//  GPIO pins 26 and 27 are the A and B outputs of the same PWM slice, so one 32-bit write
+//  to the slice's compare register sets the level of both channels. A stereo frame is in
+//  that format, and a DMA channel writes the frames to the compare register, paced by a
+//  DMA timer at the sample rate. The PWM runs at the system clock and wraps every
+//  AUDIO_PCM_LEVELS cycles, well above hearing.
+//
+//  Two DMA channels, each with its own buffer, trigger each other in turn. When one
+//  finishes, the other is already playing, and the interrupt refills the finished buffer
+//  from the callback. When the callback runs out of frames, the rest of the buffer is
+//  silence and playback stops once that buffer has played.
+//
+
+static int pcm_dma_channels[2] = {-1, -1};
+static int pcm_dma_timer = -1;
+static audio_pcm_frame_t pcm_buffers[2][AUDIO_PCM_BUFFER_FRAMES];
+static volatile bool pcm_playing = false;
+static bool pcm_ending = false;           // the callback has run out of frames
+static uint8_t pcm_last_buffer = 0;       // buffer with the last frames
+static audio_pcm_callback_t pcm_callback = NULL;
+static void *pcm_param = NULL;
+
+// Set the DMA timer to the sample rate, as near as a 16-bit fraction of the system clock allows
+static void pcm_set_sample_rate(uint32_t sample_rate)
+{
+    uint32_t clock = clock_get_hz(clk_sys);
+    uint16_t best_x = 1;
+    uint16_t best_y = 0xFFFF;
+    uint64_t best_error = UINT64_MAX;
+
+    for (uint32_t x = 1; x <= 0xFFFF; x++)
+    {
+        uint64_t y = ((uint64_t)x * clock + sample_rate / 2) / sample_rate;
+        if (y > 0xFFFF)
         {
-            audio_stop();
             break;
         }
+
+        // Compare clock * x / y with the sample rate, scaled by y to stay in integers
+        uint64_t rate = (uint64_t)clock * x;
+        uint64_t error = rate > sample_rate * y ? rate - sample_rate * y : sample_rate * y - rate;
+        if (best_error == UINT64_MAX || error * best_y < best_error * y)
+        {
+            best_x = x;
+            best_y = y;
+            best_error = error;
+        }
     }
 
-    audio_stop(); // Ensure audio is stopped at the end
+    dma_timer_set_fraction(pcm_dma_timer, best_x, best_y);
 }
 
+// Stop the DMA and give the pins back to the tones (interrupts must be disabled)
+static void pcm_halt(void)
+{
+    if (!pcm_playing)
+    {
+        return;
+    }
+
+    // Stop the channels triggering each other before aborting them
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_config config = dma_get_channel_config(pcm_dma_channels[i]);
+        channel_config_set_chain_to(&config, pcm_dma_channels[i]);
+        dma_channel_set_config(pcm_dma_channels[i], &config, false);
+        dma_channel_set_irq0_enabled(pcm_dma_channels[i], false);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_abort(pcm_dma_channels[i]);
+        dma_channel_acknowledge_irq0(pcm_dma_channels[i]);
+    }
+
+    pwm_set_enabled(pwm_gpio_to_slice_num(AUDIO_LEFT_PIN), false);
+    pio_gpio_init(pio, AUDIO_LEFT_PIN);
+    pio_gpio_init(pio, AUDIO_RIGHT_PIN);
+    pcm_playing = false;
+}
+
+// Fill a buffer from the callback and set its channel to play it when triggered
+static void pcm_fill(uint8_t buffer)
+{
+    audio_pcm_frame_t *frames = pcm_buffers[buffer];
+    uint32_t count = pcm_ending ? 0 : pcm_callback(frames, AUDIO_PCM_BUFFER_FRAMES, pcm_param);
+
+    if (count < AUDIO_PCM_BUFFER_FRAMES)
+    {
+        for (uint32_t i = count; i < AUDIO_PCM_BUFFER_FRAMES; i++)
+        {
+            frames[i] = AUDIO_PCM_FRAME(AUDIO_PCM_SILENCE, AUDIO_PCM_SILENCE);
+        }
+        if (!pcm_ending)
+        {
+            pcm_ending = true;
+            pcm_last_buffer = buffer;
+        }
+    }
+
+    dma_channel_set_read_addr(pcm_dma_channels[buffer], frames, false);
+}
+
+static void pcm_irq_handler(void)
+{
+    for (uint8_t buffer = 0; buffer < 2; buffer++)
+    {
+        if (pcm_dma_channels[buffer] < 0 || !dma_channel_get_irq0_status(pcm_dma_channels[buffer]))
+        {
+            continue;
+        }
+        dma_channel_acknowledge_irq0(pcm_dma_channels[buffer]);
+
+        if (pcm_ending && buffer == pcm_last_buffer)
+        {
+            pcm_halt(); // the last frames have played
+            return;
+        }
+        pcm_fill(buffer); // the other buffer is playing now
+    }
+}
+
+// Play sampled audio, taking the frames from the callback
+bool audio_pcm_start(uint32_t sample_rate, audio_pcm_callback_t callback, void *param)
+{
+    if (!audio_initialised || !callback ||
+        sample_rate < AUDIO_PCM_MIN_RATE || sample_rate > AUDIO_PCM_MAX_RATE)
+    {
+        return false;
+    }
+
+    audio_pcm_stop();
+    audio_song_stop(); // the pins can only play one or the other
+
+    pcm_callback = callback;
+    pcm_param = param;
+    pcm_ending = false;
+    pcm_set_sample_rate(sample_rate);
+
+    // Both channels of the slice start at silence
+    uint slice = pwm_gpio_to_slice_num(AUDIO_LEFT_PIN);
+    pwm_config pwm = pwm_get_default_config();
+    pwm_config_set_wrap(&pwm, AUDIO_PCM_LEVELS - 1);
+    pwm_init(slice, &pwm, false);
+    pwm_set_both_levels(slice, AUDIO_PCM_SILENCE, AUDIO_PCM_SILENCE);
+    gpio_set_function(AUDIO_LEFT_PIN, GPIO_FUNC_PWM);
+    gpio_set_function(AUDIO_RIGHT_PIN, GPIO_FUNC_PWM);
+    pwm_set_enabled(slice, true);
+
+    for (uint8_t buffer = 0; buffer < 2; buffer++)
+    {
+        dma_channel_config config = dma_channel_get_default_config(pcm_dma_channels[buffer]);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+        channel_config_set_read_increment(&config, true);
+        channel_config_set_write_increment(&config, false);
+        channel_config_set_dreq(&config, dma_get_timer_dreq(pcm_dma_timer));
+        channel_config_set_chain_to(&config, pcm_dma_channels[buffer ^ 1]);
+        dma_channel_configure(pcm_dma_channels[buffer], &config,
+                              &pwm_hw->slice[slice].cc,
+                              pcm_buffers[buffer],
+                              AUDIO_PCM_BUFFER_FRAMES,
+                              false);
+        pcm_fill(buffer);
+        dma_channel_acknowledge_irq0(pcm_dma_channels[buffer]);
+        dma_channel_set_irq0_enabled(pcm_dma_channels[buffer], true);
+    }
+
+    pcm_playing = true;
+    dma_channel_start(pcm_dma_channels[0]);
+    return true;
+}
+
+// Stop sampled audio
+void audio_pcm_stop(void)
+{
+    uint32_t state = save_and_disable_interrupts();
+    pcm_halt();
+    restore_interrupts(state);
+}
+
+// Check if sampled audio is playing
+bool audio_pcm_is_playing(void)
+{
+    return pcm_playing;
+}
 
 // Alarm callback function to stop tone
 static int64_t tone_stop_callback(alarm_id_t id, void *user_data)
@@ -172,8 +630,15 @@ void audio_init(void)
 
     uint offset = pio_add_program(pio, &audio_pwm_program);
 
-    audio_pwm_program_init(pio, LEFT_CHANNEL, offset, 26);
-    audio_pwm_program_init(pio, RIGHT_CHANNEL, offset, 27);
+    audio_pwm_program_init(pio, LEFT_CHANNEL, offset, AUDIO_LEFT_PIN);
+    audio_pwm_program_init(pio, RIGHT_CHANNEL, offset, AUDIO_RIGHT_PIN);
+
+    // Claim the DMA for sampled audio, the LCD uses DMA_IRQ_1
+    pcm_dma_channels[0] = dma_claim_unused_channel(true);
+    pcm_dma_channels[1] = dma_claim_unused_channel(true);
+    pcm_dma_timer = dma_claim_unused_timer(true);
+    irq_add_shared_handler(DMA_IRQ_0, pcm_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_0, true);
 
     audio_initialised = true;
 }
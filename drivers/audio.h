@@ -123,6 +123,28 @@ typedef struct {
     const char* description;    // Full song title and artist
 } audio_song_t;
 
+// Callback function type for when a song ends
+typedef void (*audio_song_callback_t)(const audio_song_t *song);
+
+// Gap after each note that is not silence
+#define AUDIO_NOTE_GAP_MS     (20)
+
+// Sampled audio
+#define AUDIO_PCM_MIN_RATE      (8000)  // lowest sample rate in Hz
+#define AUDIO_PCM_MAX_RATE      (32000) // highest sample rate in Hz
+#define AUDIO_PCM_BITS          (10)    // bits in each level
+#define AUDIO_PCM_LEVELS        (1 << AUDIO_PCM_BITS)
+#define AUDIO_PCM_SILENCE       (AUDIO_PCM_LEVELS / 2)
+#define AUDIO_PCM_BUFFER_FRAMES (256)   // frames in each of the two DMA buffers
+
+// A stereo frame: the left level (0 to AUDIO_PCM_LEVELS - 1) in the lower half and the right in the upper
+typedef uint32_t audio_pcm_frame_t;
+#define AUDIO_PCM_FRAME(left, right) ((audio_pcm_frame_t)(left) | ((audio_pcm_frame_t)(right) << 16))
+
+// Callback function type that fills a buffer with up to count frames and returns the number
+// filled; fewer than count ends the playback
+typedef uint32_t (*audio_pcm_callback_t)(audio_pcm_frame_t *frames, uint32_t count, void *param);
+
 // Audio driver function prototypes
 void audio_init(void);
 
@@ -135,3 +157,17 @@ void audio_play_song_blocking(const audio_song_t *song);
 void audio_stop(void);
 bool audio_is_playing(void);
 
+void audio_song_play(const audio_song_t *song);
+void audio_song_queue(const audio_song_t *song);
+void audio_song_pause(void);
+void audio_song_resume(void);
+void audio_song_stop(void);
+void audio_song_seek(uint32_t position_ms);
+uint32_t audio_song_position(void);
+bool audio_song_is_playing(void);
+void audio_set_song_callback(audio_song_callback_t callback);
+
+bool audio_pcm_start(uint32_t sample_rate, audio_pcm_callback_t callback, void *param);
+void audio_pcm_stop(void);
+bool audio_pcm_is_playing(void);
+
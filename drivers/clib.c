@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
 #include "pico/stdlib.h"
 #include "fat32.h"
 
@@ -104,9 +105,13 @@ int _open(const char *filename, int oflag, ...)
 
             if (oflag & O_TRUNC)
             {
-                // If O_TRUNC is set, truncate the file
-                files[i].file_size = 0;
-                files[i].position = 0;
+                // If O_TRUNC is set, truncate the file and release its clusters
+                if ((result = fat32_truncate(&files[i], 0)) != FAT32_OK)
+                {
+                    fat32_close(&files[i]);
+                    errno = fat32_error_to_errno(result);
+                    return -1; // Failed to truncate file
+                }
             }
             else if (oflag & O_APPEND)
             {
@@ -277,6 +282,40 @@ int _write(int fd, const char *buffer, int length)
     return -1;
 }
 
+int ftruncate(int fd, off_t length)
+{
+    fat32_error_t result;
+
+    if ((fd & FD_FLAG_MASK) == 0)
+    {
+        errno = EBADF; // Invalid file descriptor
+        return -1;
+    }
+
+    fd &= ~FD_FLAG_MASK; // Clear the file descriptor flag
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd].is_open)
+    {
+        errno = EBADF; // Invalid file descriptor
+        return -1;
+    }
+
+    if (length < 0)
+    {
+        errno = EINVAL; // Negative length
+        return -1;
+    }
+
+    // Growing a file links a contiguous run of clusters where one is free,
+    // the new bytes are zeroed
+    if ((result = fat32_truncate(&files[fd], length)) != FAT32_OK)
+    {
+        errno = fat32_error_to_errno(result);
+        return -1; // Truncate failed
+    }
+    return 0; // Success
+}
+
 int _fstat(int fd, struct stat *buf)
 {
     if ((fd & FD_FLAG_MASK) == 0)
@@ -5,8 +5,8 @@
 //  using the ST7789P LCD controller.
 //
 //  It is optimised for a character-based display with a fixed-width, 8-pixel wide font
-//  and 65K colours in the RGB565 format. This driver requires little memory as it
-//  uses the frame memory on the controller directly.
+//  and 65K colours in the RGB565 format. The characters on the screen are kept in a grid
+//  of cells and only the cells that change are drawn to the frame memory on the controller.
 //
 //  NOTE: Some code below is written to respect timing constraints of the ST7789P controller.
 //        For instance, you can usually get away with a short chip select high pulse widths, but
@@ -100,8 +100,6 @@ const uint16_t xterm_palette[256] = {
 //
 
 bool tab_stops[64] = {0};
-uint8_t debug[64] = {0};
-int debug_index = 0;
 
 uint8_t state = STATE_NORMAL; // initial state of escape sequence processing
 uint8_t column = 0;           // cursor x position
@@ -114,6 +112,9 @@ uint8_t save_column = 0; // saved cursor x position for DECSC/DECRC
 uint8_t save_row = 0;    // saved cursor y position for DECSC/DECRC
 uint8_t leds = 0;        // current LED state
 
+uint8_t scroll_top = 0;          // top row of the scrolling region (DECSTBM)
+uint8_t scroll_bottom = MAX_ROW; // bottom row of the scrolling region (DECSTBM)
+
 uint8_t g0_charset = CHARSET_ASCII; // G0 character set (default ASCII)
 uint8_t g1_charset = CHARSET_ASCII; // G1 character set (default ASCII)
 uint8_t active_charset = 0;         // currently active character set (0=G0, 1=G1)
@@ -169,691 +170,1606 @@ static void report(const char *msg)
     }
 }
 
-static void reset_terminal()
+//
+// Screen model
+//
+// The cells are the source of truth for what is on the screen. Changes are made to the
+// cells and the columns they touch are marked dirty in their row. The renderer then draws
+// the dirty spans, coalescing cells that share colours and attributes into runs: a run of
+// glyphs is drawn with a single line blit and a run of blank cells with a solid rectangle.
+//
+// The pen holds the colours and attributes for new cells. Outside of the renderer, the
+// LCD driver is kept set to the pen so that scrolling and the cursor use the same colours.
+//
+// Full-screen programs can switch to an alternate grid of cells and back, leaving the
+// main screen untouched underneath.
+//
+// During a synchronized update (DEC mode 2026) only the cells are changed, and scrolling
+// moves the cells rather than the display. The cells are copied when the update starts,
+// and when it ends, each dirty span is trimmed to the cells that differ from the copy, so
+// cells that changed and changed back are not drawn at all.
+//
+
+static display_cell_t main_screen[ROWS][DISPLAY_COLUMNS];
+static display_cell_t alternate_screen[ROWS][DISPLAY_COLUMNS];
+static display_cell_t (*screen)[DISPLAY_COLUMNS] = main_screen; // the cells on display
+static uint8_t dirty_first[ROWS]; // first dirty column in each row
+static uint8_t dirty_last[ROWS];  // last dirty column in each row (clean if before first)
+
+static display_cell_t sync_cells[ROWS][DISPLAY_COLUMNS]; // the cells on display when the update started
+static bool synchronized = false;                         // in a synchronized update
+static bool sync_redraw = false;                          // redraw all when the update ends
+static absolute_time_t sync_start;                        // when the update started
+
+static uint16_t pen_foreground = FOREGROUND; // foreground colour for new cells
+static uint16_t pen_background = BACKGROUND; // background colour for new cells
+static uint8_t pen_attributes = 0;           // attributes for new cells
+static bool pen_reverse = false;             // reverse video for new cells
+
+// Push the pen to the LCD driver
+static void apply_pen()
 {
-    // Reset terminal state
-    lcd_set_reverse(false);
-    lcd_set_foreground(FOREGROUND);
-    lcd_set_background(BACKGROUND);
-    lcd_set_underscore(false);
-    lcd_enable_cursor(true);
-    set_g0_charset(CHARSET_ASCII); // reset character set to ASCII
-    set_g1_charset(CHARSET_ASCII);
-    lcd_define_scrolling(0, 0); // no scrolling area defined
-    lcd_clear_screen();
-    leds = 0;          // reset LED state
-    update_leds(leds); // reset LEDs
+    lcd_set_foreground(pen_reverse ? pen_background : pen_foreground);
+    lcd_set_background(pen_reverse ? pen_foreground : pen_background);
+    lcd_set_bold(pen_attributes & CELL_BOLD);
+    lcd_set_underscore(pen_attributes & CELL_UNDERSCORE);
 }
 
-//
-// Display API
-//
+static void reset_pen()
+{
+    pen_foreground = FOREGROUND;
+    pen_background = BACKGROUND;
+    pen_attributes = 0;
+    pen_reverse = false;
+}
 
-bool display_emit_available()
+static void mark_dirty(uint8_t r, uint8_t first, uint8_t last)
 {
-    return true; // always available for output in this implementation
+    if (dirty_last[r] < dirty_first[r])
+    {
+        dirty_first[r] = first;
+        dirty_last[r] = last;
+    }
+    else
+    {
+        dirty_first[r] = MIN(dirty_first[r], first);
+        dirty_last[r] = MAX(dirty_last[r], last);
+    }
 }
 
-void display_emit(char ch)
+static void mark_clean(uint8_t r)
 {
-    int max_row = MAX_ROW;
-    int max_col = lcd_get_columns() - 1;
+    dirty_first[r] = 1;
+    dirty_last[r] = 0;
+}
+
+// Write a glyph to a cell using the pen
+static void put_cell(uint8_t c, uint8_t r, uint8_t glyph)
+{
+    if (c >= DISPLAY_COLUMNS || r >= ROWS)
+    {
+        return;
+    }
+
+    display_cell_t *cell = &screen[r][c];
+    cell->glyph = glyph;
+    cell->attributes = pen_attributes;
+    cell->foreground = pen_reverse ? pen_background : pen_foreground;
+    cell->background = pen_reverse ? pen_foreground : pen_background;
+    mark_dirty(r, c, c);
+}
 
-    lcd_erase_cursor(); // erase the cursor before processing the character
+// A blank cell in the pen's colours
+static display_cell_t blank_cell()
+{
+    return (display_cell_t){
+        .glyph = ' ',
+        .attributes = 0,
+        .foreground = pen_reverse ? pen_background : pen_foreground,
+        .background = pen_reverse ? pen_foreground : pen_background,
+    };
+}
+
+// Blank cells in a row without marking them dirty
+static void blank_cells(uint8_t r, uint8_t first, uint8_t last)
+{
+    display_cell_t blank = blank_cell();
 
-    // State machine for processing incoming characters
-    switch (state)
+    for (uint8_t c = first; c <= last && c < DISPLAY_COLUMNS; c++)
     {
-    case STATE_ESCAPE:        // ESC character received, process the next character
-        state = STATE_NORMAL; // reset state by default
-        switch (ch)
-        {
-        case CHR_CAN:                      // cancel the current escape sequence
-        case CHR_SUB:                      // same as CAN
-            lcd_putc(column++, row, 0x02); // print a error character
-            break;
-        case CHR_ESC:
-            state = STATE_ESCAPE; // stay in escape state
-            break;
-        case '7': // DECSC – Save Cursor
-            save_column = column;
-            save_row = row;
-            break;
-        case '8': // DECRC – Restore Cursor
-            column = save_column;
-            row = save_row;
-            break;
-        case 'D': // IND – Index
-            row++;
-            break;
-        case 'E': // NEL – Next Line
-            column = 0;
-            row++;
-            break;
-        case 'H': // HTS – Horizontal Tabulation Set
-            if (column < sizeof(tab_stops))
-            {
-                tab_stops[column] = true; // Set a tab stop at the current column
-            }
-            break;
-        case 'M':         // RI – Reverse Index
-            if (row == 0) // scroll at top of the screen
-            {
-                lcd_scroll_down();
-            }
-            else
-            {
-                row--;
-            }
-            break;
-        case 'c': // RIS – Reset To Initial State
-            column = row = 0;
-            reset_terminal();
-            break;
-        case '[': // CSI - Control Sequence Introducer
-            p_index = 0;
-            memset(parameters, 0, sizeof(parameters));
-            memset(debug, 0, sizeof(debug));
-            debug[0] = '\033';
-            debug[1] = ch;
-            debug_index = 2;
-            state = STATE_CS;
-            break;
-        case ']': // OSC - Operating System Command
-        case 'X': // SOS - Start of String (treat as OSC)
-        case '^': // PM - Privacy Message (treat as OSC)
-        case '_': // APC - Application Program Command (treat as OSC)
-        case 'P': // DCS - Device Control String (treat as OSC)
-            state = STATE_OSC;
-            break;
-        case '(': // SCS - G0 character set selection
-            state = STATE_G0_SET;
-            break;
-        case ')': // SCS - G1 character set selection
-            state = STATE_G1_SET;
-            break;
-        default:
-            // not a valid escape sequence, should we print an error?
-            break;
-        }
-        break;
+        screen[r][c] = blank;
+    }
+}
 
-    case STATE_CS: // in Control Sequence
-        debug[debug_index++] = ch;
-        if (ch == CHR_ESC)
-        {
-            state = STATE_ESCAPE;
-            break; // reset to escape state
-        }
-        else if (ch == '?') // DEC private mode
+// Erase cells in a row to the pen's background
+static void erase_cells(uint8_t r, uint8_t first, uint8_t last)
+{
+    if (r >= ROWS || first > last || first >= DISPLAY_COLUMNS)
+    {
+        return;
+    }
+
+    blank_cells(r, first, last);
+    mark_dirty(r, first, MIN(last, DISPLAY_COLUMNS - 1));
+}
+
+// Blank every cell and the display
+static void clear_cells()
+{
+    for (uint8_t r = 0; r < ROWS; r++)
+    {
+        blank_cells(r, 0, DISPLAY_COLUMNS - 1);
+        if (synchronized)
         {
-            state = STATE_DEC;
+            mark_dirty(r, 0, DISPLAY_COLUMNS - 1); // trimmed when the update ends
         }
-        else if (ch == '!') // TMC
+        else
         {
-            state = STATE_TMC;
+            mark_clean(r);
         }
-        else if (ch >= '0' && ch <= '9')
+    }
+
+    if (!synchronized)
+    {
+        lcd_clear_screen();
+    }
+}
+
+// Replace the cells in a row, marking dirty only the columns that change
+static void replace_cells(uint8_t r, const display_cell_t *cells)
+{
+    uint8_t first = 0;
+    uint8_t last = DISPLAY_COLUMNS - 1;
+
+    while (first <= last && memcmp(&screen[r][first], &cells[first], sizeof(display_cell_t)) == 0)
+    {
+        first++;
+    }
+    if (first > last)
+    {
+        return; // the row is unchanged
+    }
+    while (memcmp(&screen[r][last], &cells[last], sizeof(display_cell_t)) == 0)
+    {
+        last--;
+    }
+
+    memcpy(&screen[r][first], &cells[first], (last - first + 1) * sizeof(display_cell_t));
+    mark_dirty(r, first, last);
+}
+
+// Scroll the rows from top to bottom up by a number of lines. When the rows are the
+// scrolling region, the display is scrolled by the controller and the dirty spans move
+// with the cells. Otherwise the display cannot move the rows, so they are replaced and
+// only the cells that change are drawn.
+static void scroll_cells_up(uint8_t top, uint8_t bottom, uint8_t lines)
+{
+    uint8_t height = bottom - top + 1;
+    lines = MIN(lines, height);
+
+    if (top == scroll_top && bottom == scroll_bottom && !synchronized)
+    {
+        memmove(&screen[top], &screen[top + lines], sizeof(screen[0]) * (height - lines));
+        memmove(&dirty_first[top], &dirty_first[top + lines], height - lines);
+        memmove(&dirty_last[top], &dirty_last[top + lines], height - lines);
+
+        // The display clears the new lines itself
+        for (uint8_t r = bottom - lines + 1; r <= bottom; r++)
         {
-            parameters[p_index] *= 10; // accumulate digits
-            parameters[p_index] += ch - '0';
+            blank_cells(r, 0, DISPLAY_COLUMNS - 1);
+            mark_clean(r);
+            lcd_scroll_up();
         }
-        else if (ch == ';') // delimiter
+    }
+    else
+    {
+        display_cell_t blank[DISPLAY_COLUMNS];
+        for (uint8_t c = 0; c < DISPLAY_COLUMNS; c++)
         {
-            if (p_index < sizeof(parameters) - 1)
-            {
-                p_index++;
-            }
+            blank[c] = blank_cell();
         }
-        else // final character in control sequence
+
+        for (uint8_t r = top; r <= bottom; r++)
         {
-            state = STATE_NORMAL; // reset state after processing the control sequence
-            switch (ch)
-            {
-            case 'A': // CUU – Cursor Up
-                row = MAX(0, row - parameters[0]);
-                break;
-            case 'B': // CUD – Cursor Down
-                row = MIN(row + parameters[0], max_row);
-                break;
-            case 'C': // CUF – Cursor Forward
-                column = MIN(column + parameters[0], max_col);
-                break;
-            case 'D': // CUB - Cursor Backward
-                column = MAX(0, column - parameters[0]);
-                break;
-            case 'E': // CNL – CursorNext Line
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                row = MIN(row + parameters[0], max_row);
-                column = 0;
-                break;
-            case 'F': // CPL – Cursor Previous Line
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                row = MAX(0, row - parameters[0]);
-                column = 0;
-                break;
-            case 'G': // CHA - Cursor Horizontal Absolute
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                column = MIN(parameters[0] - 1, max_col);
-                column = MAX(0, column);
-                break;
-
-            case 'H': // CUP – Cursor Position
-            case 'f': // HVP – Horizontal and Vertical Position
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                if (parameters[1] == 0)
-                {
-                    parameters[1] = 1; // default to 1 if not specified
-                }
-                row = MIN(parameters[0] - 1, max_row);
-                column = MIN(parameters[1] - 1, max_col);
-                break;
-            case 'J': // ED – Erase In Display
-                if (parameters[0] == 0)
-                {
-                    // Erase from cursor to end of screen
-                    lcd_erase_line(row, column, max_col);
-                    for (uint8_t r = row + 1; r <= max_row; r++)
-                    {
-                        lcd_erase_line(r, 0, max_col);
-                    }
-                }
-                else if (parameters[0] == 1)
-                {
-                    // Erase from start of screen to cursor
-                    for (uint8_t r = 0; r < row; r++)
-                    {
-                        lcd_erase_line(r, 0, max_col);
-                    }
-                    lcd_erase_line(row, 0, column);
-                }
-                else if (parameters[0] == 2) // clear entire screen
-                {
-                    lcd_clear_screen();
-                }
-                break;
-            case 'K': // EL – Erase In Line
-                if (parameters[0] == 0)
-                {
-                    // Erase from cursor to end of line
-                    lcd_erase_line(row, column, max_col);
-                }
-                else if (parameters[0] == 1)
-                {
-                    // Erase from start of line to cursor
-                    lcd_erase_line(row, 0, column);
-                }
-                else if (parameters[0] == 2) // clear entire line
-                {
-                    lcd_erase_line(row, 0, max_col);
-                }
-                break;
-            case 'S': // SU - Scroll Up
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                while (parameters[0]-- > 0)
-                {
-                    lcd_scroll_up();
-                }
-                break;
-            case 'T': // SD - Scroll Down
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                while (parameters[0]-- > 0)
-                {
-                    lcd_scroll_down();
-                }
-                break;
-            case 'c': // DA - Device Attributes
-                report("\033[?1;c");
-                break;
-            case 'd': // VPA - Vertical Position Absolute
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                row = MIN(parameters[0] - 1, max_row);
-                break;
-            case 'e': // VPR - Vertical Position Relative
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                row = MIN(row + parameters[0], max_row);
-                break;
-            case 'g': // TBC – Tabulation Clear
-                if (parameters[0] == 3)
-                {
-                    // Clear all tab stops
-                    memset(tab_stops, 0, sizeof(tab_stops));
-                }
-                else if (parameters[0] == 0)
-                {
-                    // Clear tab stop at current column
-                    if (column < sizeof(tab_stops))
-                    {
-                        tab_stops[column] = false;
-                    }
-                }
-                break;
-            case 'l': // RM – Reset Mode
-            case 'h': // SM – Set Mode
-                break;
-            case 'm': // SGR – Select Graphic Rendition
-                for (uint8_t i = 0; i <= p_index; i++)
-                {
-                    if (parameters[i] == 0) // attributes off
-                    {
-                        lcd_set_foreground(FOREGROUND);
-                        lcd_set_background(BACKGROUND);
-                        lcd_set_underscore(false);
-                        lcd_set_reverse(false);
-                        lcd_set_bold(false);
-                    }
-                    else if (parameters[i] == 1) // bold
-                    {
-                        lcd_set_bold(true);
-                    }
-                    else if (parameters[i] == 2) // dim
-                    {
-                        lcd_set_foreground(DIM);
-                    }
-                    // No support for italic (3)
-                    else if (parameters[i] == 4) // underline
-                    {
-                        lcd_set_underscore(true);
-                    }
-                    // No support for blink (5, 6)
-                    else if (parameters[i] == 7) // negative (reverse) image
-                    {
-                        lcd_set_reverse(true);
-                    }
-                    else if (parameters[i] == 22) // normal intensity/weight
-                    {
-                        lcd_set_foreground(FOREGROUND);
-                        lcd_set_bold(false);
-                    }
-                    else if (parameters[i] == 24) // not underlined
-                    {
-                        lcd_set_underscore(false);
-                    }
-                    else if (parameters[i] == 27) // positive image
-                    {
-                        lcd_set_reverse(false);
-                    }
-                    else if (parameters[i] >= 30 && parameters[i] <= 37) // foreground colour
-                    {
-                        lcd_set_foreground(palette[parameters[i] - 30]);
-                    }
-                    else if (parameters[i] == 38 && i + 4 <= p_index && parameters[i + 1] == 2) // foreground truecolor
-                    {
-                        uint8_t r = parameters[i + 2];
-                        uint8_t g = parameters[i + 3];
-                        uint8_t b = parameters[i + 4];
-                        uint16_t colour = RGB(r, g, b);
-                        lcd_set_foreground(colour);
-                        i += 4; // Skip the next four parameters (2, r, g, b)
-                    }
-                    else if (parameters[i] == 38 && i + 2 <= p_index && parameters[i + 1] == 5) // foreground 256-colour
-                    {
-                        uint8_t colour = parameters[i + 2];
-                        lcd_set_foreground(xterm_palette[colour]);
-                        i += 2; // Skip the next two parameters (5 and colour)
-                    }
-                    else if (parameters[i] == 39) // default foreground colour
-                    {
-                        lcd_set_foreground(FOREGROUND);
-                    }
-                    else if (parameters[i] >= 40 && parameters[i] <= 47) // background colour
-                    {
-                        lcd_set_background(palette[parameters[i] - 40]);
-                    }
-                    else if (parameters[i] == 48 && i + 4 <= p_index && parameters[i + 1] == 2) // background truecolor
-                    {
-                        uint8_t r = parameters[i + 2];
-                        uint8_t g = parameters[i + 3];
-                        uint8_t b = parameters[i + 4];
-                        uint16_t colour = RGB(r, g, b);
-                        lcd_set_background(colour);
-                        i += 4; // Skip the next four parameters (2, r, g, b)
-                    }
-                    else if (parameters[i] == 48 && i + 2 <= p_index && parameters[i + 1] == 5) // background 256-colour
-                    {
-                        uint8_t colour = parameters[i + 2];
-                        lcd_set_background(xterm_palette[colour]);
-                        i += 2; // Skip the next two parameters (5 and colour)
-                    }
-                    else if (parameters[i] == 49) // default background colour
-                    {
-                        lcd_set_background(BACKGROUND);
-                    }
-                    else if (parameters[i] >= 90 && parameters[i] <= 97) // bright foreground colour
-                    {
-                        uint8_t index = parameters[i] - 90;
-                        if (index < 8) // ensure index is within bounds
-                        {
-                            lcd_set_foreground(bright_palette[index]);
-                        }
-                    }
-                    else if (parameters[i] >= 100 && parameters[i] <= 107) // bright background colour
-                    {
-                        uint8_t index = parameters[i] - 100;
-                        if (index < 8) // ensure index is within bounds
-                        {
-                            lcd_set_background(bright_palette[index]);
-                        }
-                    }
-                }
-                break;
-            case 'n':                   // Device Status Report
-                if (parameters[0] == 5) // DSR - Device Status Report
-                {
-                    report("\033[0n");
-                }
-                else if (parameters[0] == 6) // DSR - Device Status Report
-                {
-                    char buf[16];
-                    snprintf(buf, sizeof(buf), "\033[%d;%dR", row + 1, column + 1);
-                    report(buf);
-                }
-                break;
-            case CHR_CAN:                      // cancel the current escape sequence
-            case CHR_SUB:                      // same as CAN
-                lcd_putc(column++, row, 0x02); // print a error character
-                break;
-            case 'q': // DECLL – Load LEDS (DEC Private)
-                for (uint8_t i = 0; i <= p_index; i++)
-                {
-                    if (parameters[i] == 0) // turn off all LEDs
-                    {
-                        leds = 0; // reset LED state
-                    }
-                    else if (parameters[i] > 0 && parameters[i] <= 8)
-                    {
-                        leds |= (1 << (parameters[i] - 1));
-                    }
-                }
-                update_leds(leds); // update the LEDs
-                break;
-            case 'r': // DECSTBM – Set Top and Bottom Margins
-                if (parameters[0] == 0)
-                {
-                    parameters[0] = 1; // default to 1 if not specified
-                }
-                if (parameters[1] == 0)
-                {
-                    parameters[1] = 1; // default to 1 if not specified
-                }
-                uint8_t top_row = MIN(parameters[0] - 1, max_row);
-                uint8_t bottom_row = MIN(parameters[1] - 1, max_row);
-                if (bottom_row > top_row)
-                {
-                    lcd_define_scrolling(top_row, max_row - bottom_row);
-                }
-                else
-                {
-                    lcd_scroll_reset();
-                }
-                row = top_row;
-                column = 0;
-                break;
-            case 's': // DECSC – Save Cursor (ANSI)
-                save_column = column;
-                save_row = row;
-                break;
-            case 't': // - Lines per page
-                // Not supported, ignore
-                break;
-            case 'u': // DECRC – Restore Cursor (ANSI)
-                column = save_column;
-                row = save_row;
-                break;
-            default:
-                lcd_putc(column++, row, 0x02); // print a error character
-                break;                         // ignore unknown sequences
-            }
+            replace_cells(r, r + lines <= bottom ? screen[r + lines] : blank);
         }
-        break;
+    }
+}
 
-    case STATE_TMC:
-        switch (ch)
-        {
-        case 'p': // Soft reset
-            reset_terminal();
+// Scroll the rows from top to bottom down by a number of lines, as scroll_cells_up
+static void scroll_cells_down(uint8_t top, uint8_t bottom, uint8_t lines)
+{
+    uint8_t height = bottom - top + 1;
+    lines = MIN(lines, height);
 
-            break;
-        }
-        state = STATE_NORMAL;
-        break;
+    if (top == scroll_top && bottom == scroll_bottom && !synchronized)
+    {
+        memmove(&screen[top + lines], &screen[top], sizeof(screen[0]) * (height - lines));
+        memmove(&dirty_first[top + lines], &dirty_first[top], height - lines);
+        memmove(&dirty_last[top + lines], &dirty_last[top], height - lines);
 
-    case STATE_DEC: // in DEC private mode sequence
-        debug[debug_index++] = ch;
-        if (ch == CHR_ESC)
-        {
-            state = STATE_ESCAPE;
-            break; // reset to escape state
-        }
-        else if (ch >= '0' && ch <= '9')
+        // The display clears the new lines itself
+        for (uint8_t r = top; r < top + lines; r++)
         {
-            parameters[p_index] *= 10; // accumulate digits
-            parameters[p_index] += ch - '0';
+            blank_cells(r, 0, DISPLAY_COLUMNS - 1);
+            mark_clean(r);
+            lcd_scroll_down();
         }
-        else if (ch == ';') // delimiter
+    }
+    else
+    {
+        display_cell_t blank[DISPLAY_COLUMNS];
+        for (uint8_t c = 0; c < DISPLAY_COLUMNS; c++)
         {
-            if (p_index < sizeof(parameters) - 1)
-            {
-                p_index++;
-            }
+            blank[c] = blank_cell();
         }
-        else // final character in DEC private mode sequence
+
+        for (int r = bottom; r >= top; r--)
         {
-            state = STATE_NORMAL; // reset state after processing
-            switch (ch)
-            {
-            case 'h':                    // DECSET - DEC Private Mode Set
-                if (parameters[0] == 25) // DECTCEM - Text Cursor Enable Mode
-                {
-                    lcd_enable_cursor(true);
-                    lcd_draw_cursor();
-                }
-                else if (parameters[0] == 4264)
-                {
-                    // set 64 column mode
-                    lcd_set_font(&font_5x10);
-                }
-                break;
-            case 'l':                    // DECRST - DEC Private Mode Reset
-                if (parameters[0] == 25) // DECTCEM - Text Cursor Enable Mode
-                {
-                    lcd_enable_cursor(false);
-                    lcd_erase_cursor(); // immediately hide cursor
-                }
-                else if (parameters[0] == 4264)
-                {
-                    // set 64 column mode
-                    lcd_set_font(&font_8x10);
-                }
-                break;
-            case 'm':
-                // Ignore for now
-                break;
-            default:
-                lcd_putc(column++, row, 0x01); // print a error character
-                break;                         // ignore unknown DEC private mode sequences
-            }
+            replace_cells(r, r - lines >= top ? screen[r - lines] : blank);
         }
-        break;
+    }
+}
 
-    case STATE_G0_SET:        // Setting G0 character set
-        state = STATE_NORMAL; // return to normal state after processing
-        switch (ch)
+static void scrollback_push(const display_cell_t *cells);
+
+// Scroll the scrolling region up, keeping the lines that leave the top of the main
+// screen in the scrollback
+static void scroll_up(uint8_t lines)
+{
+    if (scroll_top == 0 && screen == main_screen)
+    {
+        for (uint8_t r = 0; r < lines && r <= scroll_bottom; r++)
         {
-        case 'A': // UK character set
-            set_g0_charset(CHARSET_UK);
-            break;
-        case 'B': // ASCII character set
-            set_g0_charset(CHARSET_ASCII);
-            break;
-        case '0': // DEC Special Character Set
-            set_g0_charset(CHARSET_DEC);
-            break;
-        default:
-            // Unknown character set, ignore
-            break;
+            scrollback_push(screen[r]);
         }
-        break;
+    }
+    scroll_cells_up(scroll_top, scroll_bottom, lines);
+}
+
+// Move the cursor down a line, scrolling the region up at its bottom margin
+static void line_feed()
+{
+    if (row == scroll_bottom)
+    {
+        scroll_up(1);
+    }
+    else if (row < MAX_ROW)
+    {
+        row++;
+    }
+}
+
+static bool is_blank(const display_cell_t *cell)
+{
+    return cell->glyph == ' ' && !(cell->attributes & CELL_UNDERSCORE);
+}
+
+// Check if two cells can be drawn in the same run
+static bool same_style(const display_cell_t *a, const display_cell_t *b)
+{
+    if (is_blank(a))
+    {
+        return is_blank(b) && a->background == b->background;
+    }
+    return !is_blank(b) &&
+           a->attributes == b->attributes &&
+           a->foreground == b->foreground &&
+           a->background == b->background;
+}
 
-    case STATE_G1_SET:        // Setting G1 character set
-        state = STATE_NORMAL; // return to normal state after processing
-        switch (ch)
+// Draw a span of a row of cells to a row of the display, the LCD driver is left set to
+// the colours of the last run of glyphs
+static void render_cells(uint8_t r, const display_cell_t *cells, uint8_t first, uint8_t last)
+{
+    uint8_t glyph_width = lcd_get_glyph_width();
+
+    while (first <= last)
+    {
+        const display_cell_t *cell = &cells[first];
+        uint8_t end = first + 1;
+        while (end <= last && same_style(cell, &cells[end]))
         {
-        case 'A': // UK character set
-            set_g1_charset(CHARSET_UK);
-            break;
-        case 'B': // ASCII character set
-            set_g1_charset(CHARSET_ASCII);
-            break;
-        case '0': // DEC Special Character Set
-            set_g1_charset(CHARSET_DEC);
-            break;
-        default:
-            // Unknown character set, ignore
-            break;
+            end++;
         }
-        break;
 
-    case STATE_OSC: // in Operating System Command
-        if (ch == CHR_ESC)
+        if (is_blank(cell))
         {
-            state = STATE_OSC_ESC;
+            lcd_solid_rectangle(cell->background, first * glyph_width, r * GLYPH_HEIGHT, (end - first) * glyph_width, GLYPH_HEIGHT);
         }
-        else if (ch == '\007' || ch == 0x9C)
+        else
         {
-            state = STATE_NORMAL; // reset state after processing the OSC sequence
+            uint8_t glyphs[DISPLAY_COLUMNS];
+            for (uint8_t c = first; c < end; c++)
+            {
+                glyphs[c - first] = cells[c].glyph;
+            }
+
+            lcd_set_foreground(cell->foreground);
+            lcd_set_background(cell->background);
+            lcd_set_bold(cell->attributes & CELL_BOLD);
+            lcd_set_underscore(cell->attributes & CELL_UNDERSCORE);
+            lcd_putchars(first, r, glyphs, end - first);
         }
-        break;
 
-    case STATE_OSC_ESC: // in OSC escape sequence
-        state = ch == '\\' ? STATE_NORMAL : STATE_OSC;
-        break;
+        first = end;
+    }
+}
 
-    case STATE_NORMAL:
-    default:
-        // Normal/default state, process characters directly
-        switch (ch)
+// Draw the dirty spans of the cells to the display
+static void render_dirty()
+{
+    uint8_t max_col = lcd_get_columns() - 1;
+    bool rendered = false;
+
+    if (synchronized)
+    {
+        return; // drawn when the update ends
+    }
+
+    for (uint8_t r = 0; r < ROWS; r++)
+    {
+        if (dirty_last[r] < dirty_first[r])
         {
-        case CHR_BS:
-            column = MAX(0, column - 1); // move cursor back one space (but not before the start of the line)
-            break;
-        case CHR_BEL:
-            ring_bell(); // ring the bell
-            break;
-        case CHR_HT:
-            column = MIN(((column + 8) & ~7), lcd_get_columns() - 1); // move cursor to next tabstop (but not beyond the end of the line)
-            break;
-        case CHR_LF:
-        case CHR_VT:
-        case CHR_FF:
-            row++; // move cursor down one line
-            break;
-        case CHR_CR:
-            column = 0; // move cursor to the start of the line
-            break;
-        case CHR_SO: // Shift Out - select G1 character set
-            set_charset(G1_CHARSET);
-            break;
-        case CHR_SI: // Shift In - select G0 character set
-            set_charset(G0_CHARSET);
-            break;
-        case CHR_ESC:
-            state = STATE_ESCAPE;
-            break;
-        default:
-            if (ch >= 0x20 && ch < 0x7F) // printable characters
-            {
-                // Translate character based on active character set
-                if (get_charset() == CHARSET_UK && ch == '#')
-                {
-                    // Replace '#' with the pound sign in UK character set
-                    ch = 0x1E;
-                }
-                else if (get_charset() == CHARSET_DEC && ch >= 0x5F && ch <= 0x7E)
-                {
-                    // Maps characters 0x5F - 0x7E to DEC Special Character Set
-                    ch -= 0x5F;
-                }
-
-                lcd_putc(column++, row, ch);
-            }
-            break;
+            continue;
         }
-        break;
+
+        render_cells(r, screen[r], dirty_first[r], MIN(dirty_last[r], max_col));
+        mark_clean(r);
+        rendered = true;
     }
 
-    // Handle wrapping and scrolling
-    if (column > max_col) // wrap around at end of the line
+    if (rendered)
     {
-        column = 0;
-        row++;
+        apply_pen(); // put the LCD driver back to the pen
+    }
+}
+
+// Redraw the whole screen from the cells
+void display_redraw()
+{
+    for (uint8_t r = 0; r < ROWS; r++)
+    {
+        mark_dirty(r, 0, DISPLAY_COLUMNS - 1);
+    }
+    sync_redraw = synchronized; // the copy no longer matches the display
+    render_dirty();
+}
+
+// Start a synchronized update
+static void begin_synchronized()
+{
+    if (synchronized)
+    {
+        return;
+    }
+
+    render_dirty(); // the display must match the copy
+    memcpy(sync_cells, screen, sizeof(sync_cells));
+    synchronized = true;
+    sync_redraw = false;
+    sync_start = get_absolute_time();
+}
+
+// End a synchronized update, trimming the dirty spans to the cells that changed
+static void end_synchronized()
+{
+    if (!synchronized)
+    {
+        return;
+    }
+
+    synchronized = false;
+    if (sync_redraw)
+    {
+        return;
     }
 
-    if (row > max_row) // scroll at bottom of the screen
+    for (uint8_t r = 0; r < ROWS; r++)
     {
-        while (row > max_row) // scroll until y is within bounds
+        uint8_t first = dirty_first[r];
+        uint8_t last = dirty_last[r];
+
+        while (first <= last && memcmp(&screen[r][first], &sync_cells[r][first], sizeof(display_cell_t)) == 0)
         {
-            lcd_scroll_up(); // scroll up to make space at the bottom
-            row--;
+            first++;
+        }
+        if (first > last)
+        {
+            mark_clean(r);
+            continue;
+        }
+        while (memcmp(&screen[r][last], &sync_cells[r][last], sizeof(display_cell_t)) == 0)
+        {
+            last--;
         }
-    }
 
-    // Update cursor position
-    lcd_move_cursor(column, row);
-    lcd_draw_cursor(); // draw the cursor at the new position
+        dirty_first[r] = first;
+        dirty_last[r] = last;
+    }
 }
 
 //
-//  Display Callback Setters
+// Scrollback
+//
+// Lines scrolled off the top of the main screen are kept in a ring of compressed lines.
+// A line is stored as runs of cells that share attributes and colours, where a run of
+// blank cells has no glyphs, and the blank cells at the end of the line are dropped. The
+// length of each line is stored before and after it so that the ring can be walked in
+// either direction. When the ring is full, the oldest lines are dropped.
+//
+// Reviewing the scrollback moves the display with the controller's vertical scrolling
+// and draws only the line that comes into view.
 //
 
-void display_set_led_callback(led_callback_t callback)
+#define SCROLLBACK_RUN_BLANK (0x80) // run of blank cells, stored without glyphs
+
+static uint8_t scrollback[DISPLAY_SCROLLBACK_SIZE];
+static uint32_t scrollback_head = 0;  // position after the newest line
+static uint32_t scrollback_tail = 0;  // position of the oldest line
+static uint32_t scrollback_lines = 0; // number of lines in the ring
+static uint32_t review_offset = 0;    // lines the review is back from the live screen
+static bool review_cursor = false;    // cursor state before the review started
+
+static inline uint8_t scrollback_get(uint32_t pos)
 {
-    display_led_callback = callback;
+    return scrollback[pos % DISPLAY_SCROLLBACK_SIZE];
 }
 
-void display_set_bell_callback(bell_callback_t callback)
+static inline uint16_t scrollback_get16(uint32_t pos)
 {
-    display_bell_callback = callback;
+    return scrollback_get(pos) | (scrollback_get(pos + 1) << 8);
 }
 
-void display_set_report_callback(report_callback_t callback)
+static inline void scrollback_put(uint32_t pos, uint8_t value)
 {
-    display_report_callback = callback;
+    scrollback[pos % DISPLAY_SCROLLBACK_SIZE] = value;
 }
 
-//
-//  Display Initialization
-//
+static inline void scrollback_put16(uint32_t pos, uint16_t value)
+{
+    scrollback_put(pos, LOWER8(value));
+    scrollback_put(pos + 1, UPPER8(value));
+}
 
-void display_init()
+// Compress a line of cells into the ring
+static void scrollback_push(const display_cell_t *cells)
 {
-    // Make sure the LCD is initialized
-    lcd_init();
+    uint8_t encoded[DISPLAY_COLUMNS * 7]; // a run for every cell at worst
+    uint16_t length = 0;
+    uint8_t count = DISPLAY_COLUMNS;
+
+    // Drop the blank cells at the end of the line
+    while (count > 0 && is_blank(&cells[count - 1]) && cells[count - 1].background == BACKGROUND)
+    {
+        count--;
+    }
+
+    for (uint8_t c = 0; c < count;)
+    {
+        const display_cell_t *cell = &cells[c];
+        bool blank = is_blank(cell);
+        uint8_t end = c + 1;
+        while (end < count && same_style(cell, &cells[end]))
+        {
+            end++;
+        }
+
+        encoded[length++] = end - c;
+        encoded[length++] = cell->attributes | (blank ? SCROLLBACK_RUN_BLANK : 0);
+        encoded[length++] = LOWER8(cell->foreground);
+        encoded[length++] = UPPER8(cell->foreground);
+        encoded[length++] = LOWER8(cell->background);
+        encoded[length++] = UPPER8(cell->background);
+        if (!blank)
+        {
+            for (uint8_t i = c; i < end; i++)
+            {
+                encoded[length++] = cells[i].glyph;
+            }
+        }
+        c = end;
+    }
+
+    // Make room by dropping the oldest lines
+    while (DISPLAY_SCROLLBACK_SIZE - (scrollback_head - scrollback_tail) < length + 4u)
+    {
+        scrollback_tail += scrollback_get16(scrollback_tail) + 4;
+        scrollback_lines--;
+    }
+
+    scrollback_put16(scrollback_head, length);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        scrollback_put(scrollback_head + 2 + i, encoded[i]);
+    }
+    scrollback_put16(scrollback_head + 2 + length, length);
+    scrollback_head += length + 4;
+    scrollback_lines++;
+}
+
+// Expand the line stored at a position into a row of cells
+static void scrollback_read(uint32_t pos, display_cell_t *cells)
+{
+    uint32_t end = pos + 2 + scrollback_get16(pos);
+    uint8_t c = 0;
+
+    pos += 2;
+    while (pos < end)
+    {
+        uint8_t count = scrollback_get(pos);
+        uint8_t attributes = scrollback_get(pos + 1);
+        uint16_t foreground = scrollback_get16(pos + 2);
+        uint16_t background = scrollback_get16(pos + 4);
+        pos += 6;
+
+        while (count-- > 0)
+        {
+            cells[c].glyph = (attributes & SCROLLBACK_RUN_BLANK) ? ' ' : scrollback_get(pos++);
+            cells[c].attributes = attributes & ~SCROLLBACK_RUN_BLANK;
+            cells[c].foreground = foreground;
+            cells[c].background = background;
+            c++;
+        }
+    }
+
+    while (c < DISPLAY_COLUMNS)
+    {
+        cells[c++] = (display_cell_t){.glyph = ' ', .foreground = FOREGROUND, .background = BACKGROUND};
+    }
+}
+
+// Get a line of the review, counting the scrollback and then the main screen from the oldest
+static void review_line(uint32_t index, display_cell_t *cells)
+{
+    if (index >= scrollback_lines)
+    {
+        memcpy(cells, main_screen[index - scrollback_lines], sizeof(main_screen[0]));
+        return;
+    }
+
+    // Walk back from the newest line
+    uint32_t pos = scrollback_head;
+    for (uint32_t back = scrollback_lines - index; back > 0; back--)
+    {
+        pos -= scrollback_get16(pos - 2) + 4;
+    }
+    scrollback_read(pos, cells);
+}
+
+// Move the review back (positive) or forward (negative) through the scrollback
+void display_review(int lines)
+{
+    uint8_t max_col = lcd_get_columns() - 1;
+    display_cell_t cells[DISPLAY_COLUMNS];
+
+    if (screen != main_screen || scroll_top != 0 || scroll_bottom != MAX_ROW || synchronized ||
+        (review_offset == 0 && lines <= 0))
+    {
+        return;
+    }
+
+    if (review_offset == 0)
+    {
+        // Hide the cursor while reviewing
+        review_cursor = lcd_cursor_enabled();
+        lcd_erase_cursor();
+        lcd_enable_cursor(false);
+    }
+
+    while (lines > 0 && review_offset < scrollback_lines)
+    {
+        // Scroll the display down and draw the line that comes in at the top
+        review_offset++;
+        lines--;
+        lcd_scroll_down();
+        review_line(scrollback_lines - review_offset, cells);
+        render_cells(0, cells, 0, max_col);
+    }
+
+    while (lines < 0 && review_offset > 0)
+    {
+        // Scroll the display up and draw the line that comes in at the bottom
+        review_offset--;
+        lines++;
+        lcd_scroll_up();
+        review_line(scrollback_lines - review_offset + MAX_ROW, cells);
+        render_cells(MAX_ROW, cells, 0, max_col);
+    }
+
+    apply_pen();
+
+    if (review_offset == 0)
+    {
+        lcd_enable_cursor(review_cursor);
+        lcd_draw_cursor();
+    }
+}
+
+// Return to the live screen
+void display_review_end()
+{
+    if (review_offset >= ROWS)
+    {
+        // Redrawing is quicker than scrolling back line by line
+        review_offset = 0;
+        display_redraw();
+        lcd_enable_cursor(review_cursor);
+        lcd_draw_cursor();
+    }
+    else
+    {
+        display_review(-(int)review_offset);
+    }
+}
+
+// Check if the scrollback is being reviewed
+bool display_is_reviewing(void)
+{
+    return review_offset != 0;
+}
+
+// Get the number of lines in the scrollback and the bytes they take
+void display_get_scrollback_stats(uint32_t *lines, uint32_t *bytes)
+{
+    if (lines)
+    {
+        *lines = scrollback_lines;
+    }
+    if (bytes)
+    {
+        *bytes = scrollback_head - scrollback_tail;
+    }
+}
+
+// Switch between the main and alternate screens, clearing the one switched to or
+// redrawing it
+static void select_screen(bool alternate, bool clear)
+{
+    display_cell_t (*target)[DISPLAY_COLUMNS] = alternate ? alternate_screen : main_screen;
+
+    if (screen == target && !clear)
+    {
+        return;
+    }
+
+    screen = target;
+    if (clear)
+    {
+        clear_cells();
+    }
+    else
+    {
+        display_redraw();
+    }
+}
+
+static void reset_terminal()
+{
+    // Reset terminal state
+    reset_pen();
+    apply_pen();
+    lcd_enable_cursor(true);
+    set_g0_charset(CHARSET_ASCII); // reset character set to ASCII
+    set_g1_charset(CHARSET_ASCII);
+    lcd_define_scrolling(0, 0); // no scrolling area defined
+    scroll_top = 0;
+    scroll_bottom = MAX_ROW;
+    synchronized = false; // end a synchronized update
+    screen = main_screen; // leave the alternate screen
+    clear_cells();
+    leds = 0;          // reset LED state
+    update_leds(leds); // reset LEDs
+}
+
+//
+// Display API
+//
+
+bool display_emit_available()
+{
+    return true; // always available for output in this implementation
+}
+
+// Translate a printable character through the active character set
+static inline uint8_t translate_char(uint8_t charset, char ch)
+{
+    if (charset == CHARSET_UK && ch == '#')
+    {
+        // Replace '#' with the pound sign in UK character set
+        return 0x1E;
+    }
+    else if (charset == CHARSET_DEC && ch >= 0x5F && ch <= 0x7E)
+    {
+        // Maps characters 0x5F - 0x7E to DEC Special Character Set
+        return ch - 0x5F;
+    }
+    return ch;
+}
+
+//
+// Escape sequence parser
+//
+// The parser is a table-driven state machine in the style of the vt100.net state diagram
+// (https://vt100.net/emu/dec_ansi_parser). Each character is sorted into a class, and
+// the class and the current state select a transition: the next state in the low nibble
+// and the action to carry out in the high nibble.
+//
+
+#define T(action, next) ((ACTION_##action << 4) | STATE_##next)
+
+static const uint8_t char_classes[256] = {
+    [0x00 ... 0x1F] = CLASS_CONTROL,
+    [CHR_BEL] = CLASS_BEL,
+    [CHR_CAN] = CLASS_CANCEL,
+    [CHR_SUB] = CLASS_CANCEL,
+    [CHR_ESC] = CLASS_ESC,
+    [0x20 ... 0x7E] = CLASS_PRINT,
+    ['0' ... '9'] = CLASS_DIGIT,
+    [';'] = CLASS_SEPARATOR,
+    ['$'] = CLASS_DOLLAR,
+    ['?'] = CLASS_PRIVATE,
+    ['!'] = CLASS_BANG,
+    ['['] = CLASS_CSI,
+    [']'] = CLASS_STRING,
+    ['X'] = CLASS_STRING,
+    ['^'] = CLASS_STRING,
+    ['_'] = CLASS_STRING,
+    ['P'] = CLASS_STRING,
+    ['('] = CLASS_G0,
+    [')'] = CLASS_G1,
+    ['\\'] = CLASS_BACKSLASH,
+    [0x7F ... 0xFF] = CLASS_OTHER,
+    [0x9C] = CLASS_ST,
+};
+
+static const uint8_t transitions[STATE_COUNT][CLASS_COUNT] = {
+    [STATE_NORMAL] = {
+        [CLASS_CONTROL] = T(EXECUTE, NORMAL),
+        [CLASS_BEL] = T(EXECUTE, NORMAL),
+        [CLASS_CANCEL] = T(EXECUTE, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT ... CLASS_PRINT] = T(PRINT, NORMAL),
+        [CLASS_OTHER] = T(NONE, NORMAL),
+        [CLASS_DOLLAR] = T(PRINT, NORMAL),
+        [CLASS_ST] = T(NONE, NORMAL),
+    },
+    [STATE_ESCAPE] = {
+        [CLASS_CONTROL] = T(EXECUTE, ESCAPE),
+        [CLASS_BEL] = T(EXECUTE, ESCAPE),
+        [CLASS_CANCEL] = T(CANCEL, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT ... CLASS_ST] = T(ESC_DISPATCH, NORMAL),
+        [CLASS_CSI] = T(CLEAR, CS),
+        [CLASS_STRING] = T(NONE, OSC),
+        [CLASS_G0] = T(NONE, G0_SET),
+        [CLASS_G1] = T(NONE, G1_SET),
+    },
+    [STATE_CS] = {
+        [CLASS_CONTROL] = T(EXECUTE, CS),
+        [CLASS_BEL] = T(EXECUTE, CS),
+        [CLASS_CANCEL] = T(CANCEL, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT] = T(PARAM, CS),
+        [CLASS_SEPARATOR] = T(NEXT_PARAM, CS),
+        [CLASS_PRIVATE] = T(NONE, DEC),
+        [CLASS_BANG] = T(NONE, TMC),
+        [CLASS_CSI ... CLASS_ST] = T(CSI_DISPATCH, NORMAL),
+    },
+    [STATE_DEC] = {
+        [CLASS_CONTROL] = T(EXECUTE, DEC),
+        [CLASS_BEL] = T(EXECUTE, DEC),
+        [CLASS_CANCEL] = T(DEC_DISPATCH, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT] = T(PARAM, DEC),
+        [CLASS_SEPARATOR] = T(NEXT_PARAM, DEC),
+        [CLASS_PRIVATE ... CLASS_ST] = T(DEC_DISPATCH, NORMAL),
+        [CLASS_DOLLAR] = T(NONE, DEC_REQUEST),
+    },
+    [STATE_DEC_REQUEST] = {
+        [CLASS_CONTROL] = T(EXECUTE, DEC_REQUEST),
+        [CLASS_BEL] = T(EXECUTE, DEC_REQUEST),
+        [CLASS_CANCEL] = T(NONE, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT ... CLASS_ST] = T(DEC_REQUEST, NORMAL),
+    },
+    [STATE_G0_SET] = {
+        [CLASS_CONTROL] = T(EXECUTE, G0_SET),
+        [CLASS_BEL] = T(EXECUTE, G0_SET),
+        [CLASS_CANCEL] = T(NONE, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT ... CLASS_ST] = T(G0_DESIGNATE, NORMAL),
+    },
+    [STATE_G1_SET] = {
+        [CLASS_CONTROL] = T(EXECUTE, G1_SET),
+        [CLASS_BEL] = T(EXECUTE, G1_SET),
+        [CLASS_CANCEL] = T(NONE, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT ... CLASS_ST] = T(G1_DESIGNATE, NORMAL),
+    },
+    [STATE_OSC] = {
+        [CLASS_CONTROL ... CLASS_ST] = T(NONE, OSC),
+        [CLASS_BEL] = T(NONE, NORMAL),
+        [CLASS_ESC] = T(NONE, OSC_ESC),
+        [CLASS_ST] = T(NONE, NORMAL),
+    },
+    [STATE_OSC_ESC] = {
+        [CLASS_CONTROL ... CLASS_ST] = T(NONE, OSC),
+        [CLASS_BACKSLASH] = T(NONE, NORMAL),
+    },
+    [STATE_TMC] = {
+        [CLASS_CONTROL] = T(EXECUTE, TMC),
+        [CLASS_BEL] = T(EXECUTE, TMC),
+        [CLASS_CANCEL] = T(NONE, NORMAL),
+        [CLASS_ESC] = T(NONE, ESCAPE),
+        [CLASS_DIGIT ... CLASS_ST] = T(TMC_DISPATCH, NORMAL),
+    },
+};
+
+#undef T
+
+// Execute a control character
+static void execute_control(char ch)
+{
+    switch (ch)
+    {
+    case CHR_BS:
+        column = MAX(0, column - 1); // move cursor back one space (but not before the start of the line)
+        break;
+    case CHR_BEL:
+        ring_bell(); // ring the bell
+        break;
+    case CHR_HT:
+        column = MIN(((column + 8) & ~7), lcd_get_columns() - 1); // move cursor to next tabstop (but not beyond the end of the line)
+        break;
+    case CHR_LF:
+    case CHR_VT:
+    case CHR_FF:
+        line_feed(); // move cursor down one line
+        break;
+    case CHR_CR:
+        column = 0; // move cursor to the start of the line
+        break;
+    case CHR_SO: // Shift Out - select G1 character set
+        set_charset(G1_CHARSET);
+        break;
+    case CHR_SI: // Shift In - select G0 character set
+        set_charset(G0_CHARSET);
+        break;
+    default:
+        break; // other control characters are ignored
+    }
+}
+
+// Dispatch the final character of an escape sequence
+static void esc_dispatch(char ch)
+{
+    switch (ch)
+    {
+    case '7': // DECSC – Save Cursor
+        save_column = column;
+        save_row = row;
+        break;
+    case '8': // DECRC – Restore Cursor
+        column = save_column;
+        row = save_row;
+        break;
+    case 'D': // IND – Index
+        line_feed();
+        break;
+    case 'E': // NEL – Next Line
+        column = 0;
+        line_feed();
+        break;
+    case 'H': // HTS – Horizontal Tabulation Set
+        if (column < sizeof(tab_stops))
+        {
+            tab_stops[column] = true; // Set a tab stop at the current column
+        }
+        break;
+    case 'M':                  // RI – Reverse Index
+        if (row == scroll_top) // scroll at the top margin
+        {
+            scroll_cells_down(scroll_top, scroll_bottom, 1);
+        }
+        else if (row > 0)
+        {
+            row--;
+        }
+        break;
+    case 'c': // RIS – Reset To Initial State
+        column = row = 0;
+        reset_terminal();
+        break;
+    default:
+        // not a valid escape sequence, should we print an error?
+        break;
+    }
+}
+
+// Designate a character set to G0 or G1
+static void designate_charset(uint8_t g, char ch)
+{
+    uint8_t charset;
+
+    switch (ch)
+    {
+    case 'A': // UK character set
+        charset = CHARSET_UK;
+        break;
+    case 'B': // ASCII character set
+        charset = CHARSET_ASCII;
+        break;
+    case '0': // DEC Special Character Set
+        charset = CHARSET_DEC;
+        break;
+    default:
+        return; // Unknown character set, ignore
+    }
+
+    if (g == G0_CHARSET)
+    {
+        set_g0_charset(charset);
+    }
+    else
+    {
+        set_g1_charset(charset);
+    }
+}
+
+// SGR – Select Graphic Rendition
+static void select_graphic_rendition(const uint16_t *params, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint16_t p = params[i];
+
+        if (p == 0) // attributes off
+        {
+            reset_pen();
+        }
+        else if (p == 1) // bold
+        {
+            pen_attributes |= CELL_BOLD;
+        }
+        else if (p == 2) // dim
+        {
+            pen_foreground = DIM;
+        }
+        // No support for italic (3)
+        else if (p == 4) // underline
+        {
+            pen_attributes |= CELL_UNDERSCORE;
+        }
+        // No support for blink (5, 6)
+        else if (p == 7) // negative (reverse) image
+        {
+            pen_reverse = true;
+        }
+        else if (p == 22) // normal intensity/weight
+        {
+            pen_foreground = FOREGROUND;
+            pen_attributes &= ~CELL_BOLD;
+        }
+        else if (p == 24) // not underlined
+        {
+            pen_attributes &= ~CELL_UNDERSCORE;
+        }
+        else if (p == 27) // positive image
+        {
+            pen_reverse = false;
+        }
+        else if (p >= 30 && p <= 37) // foreground colour
+        {
+            pen_foreground = palette[p - 30];
+        }
+        else if (p == 38 && i + 5 <= count && params[i + 1] == 2) // foreground truecolor
+        {
+            pen_foreground = RGB((uint8_t)params[i + 2], (uint8_t)params[i + 3], (uint8_t)params[i + 4]);
+            i += 4; // Skip the next four parameters (2, r, g, b)
+        }
+        else if (p == 38 && i + 3 <= count && params[i + 1] == 5) // foreground 256-colour
+        {
+            pen_foreground = xterm_palette[(uint8_t)params[i + 2]];
+            i += 2; // Skip the next two parameters (5 and colour)
+        }
+        else if (p == 39) // default foreground colour
+        {
+            pen_foreground = FOREGROUND;
+        }
+        else if (p >= 40 && p <= 47) // background colour
+        {
+            pen_background = palette[p - 40];
+        }
+        else if (p == 48 && i + 5 <= count && params[i + 1] == 2) // background truecolor
+        {
+            pen_background = RGB((uint8_t)params[i + 2], (uint8_t)params[i + 3], (uint8_t)params[i + 4]);
+            i += 4; // Skip the next four parameters (2, r, g, b)
+        }
+        else if (p == 48 && i + 3 <= count && params[i + 1] == 5) // background 256-colour
+        {
+            pen_background = xterm_palette[(uint8_t)params[i + 2]];
+            i += 2; // Skip the next two parameters (5 and colour)
+        }
+        else if (p == 49) // default background colour
+        {
+            pen_background = BACKGROUND;
+        }
+        else if (p >= 90 && p <= 97) // bright foreground colour
+        {
+            pen_foreground = bright_palette[p - 90];
+        }
+        else if (p >= 100 && p <= 107) // bright background colour
+        {
+            pen_background = bright_palette[p - 100];
+        }
+    }
+    apply_pen();
+}
+
+// CUP – Cursor Position
+static void cursor_position(uint16_t r, uint16_t c)
+{
+    row = MIN(MAX(r, 1) - 1, MAX_ROW);
+    column = MIN(MAX(c, 1) - 1, lcd_get_columns() - 1);
+}
+
+// EL – Erase In Line
+static void erase_in_line(uint16_t mode)
+{
+    if (mode == 0)
+    {
+        // Erase from cursor to end of line
+        erase_cells(row, column, lcd_get_columns() - 1);
+    }
+    else if (mode == 1)
+    {
+        // Erase from start of line to cursor
+        erase_cells(row, 0, column);
+    }
+    else if (mode == 2) // clear entire line
+    {
+        erase_cells(row, 0, lcd_get_columns() - 1);
+    }
+}
+
+// Dispatch the final character of a control sequence
+static void csi_dispatch(char ch)
+{
+    int max_row = MAX_ROW;
+    int max_col = lcd_get_columns() - 1;
+
+    switch (ch)
+    {
+    case 'A': // CUU – Cursor Up
+        row = MAX(0, row - parameters[0]);
+        break;
+    case 'B': // CUD – Cursor Down
+        row = MIN(row + parameters[0], max_row);
+        break;
+    case 'C': // CUF – Cursor Forward
+        column = MIN(column + parameters[0], max_col);
+        break;
+    case 'D': // CUB - Cursor Backward
+        column = MAX(0, column - parameters[0]);
+        break;
+    case 'E': // CNL – CursorNext Line
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        row = MIN(row + parameters[0], max_row);
+        column = 0;
+        break;
+    case 'F': // CPL – Cursor Previous Line
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        row = MAX(0, row - parameters[0]);
+        column = 0;
+        break;
+    case 'G': // CHA - Cursor Horizontal Absolute
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        column = MIN(parameters[0] - 1, max_col);
+        column = MAX(0, column);
+        break;
+    case 'H': // CUP – Cursor Position
+    case 'f': // HVP – Horizontal and Vertical Position
+        cursor_position(parameters[0], parameters[1]);
+        break;
+    case 'J': // ED – Erase In Display
+        if (parameters[0] == 0)
+        {
+            // Erase from cursor to end of screen
+            erase_cells(row, column, max_col);
+            for (uint8_t r = row + 1; r <= max_row; r++)
+            {
+                erase_cells(r, 0, max_col);
+            }
+        }
+        else if (parameters[0] == 1)
+        {
+            // Erase from start of screen to cursor
+            for (uint8_t r = 0; r < row; r++)
+            {
+                erase_cells(r, 0, max_col);
+            }
+            erase_cells(row, 0, column);
+        }
+        else if (parameters[0] == 2) // clear entire screen
+        {
+            clear_cells();
+        }
+        break;
+    case 'K': // EL – Erase In Line
+        erase_in_line(parameters[0]);
+        break;
+    case 'S': // SU - Scroll Up
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        scroll_up(MIN(parameters[0], ROWS));
+        break;
+    case 'T': // SD - Scroll Down
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        scroll_cells_down(scroll_top, scroll_bottom, MIN(parameters[0], ROWS));
+        break;
+    case 'L': // IL - Insert Line
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        if (row >= scroll_top && row <= scroll_bottom)
+        {
+            scroll_cells_down(row, scroll_bottom, MIN(parameters[0], ROWS));
+            column = 0;
+        }
+        break;
+    case 'M': // DL - Delete Line
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        if (row >= scroll_top && row <= scroll_bottom)
+        {
+            scroll_cells_up(row, scroll_bottom, MIN(parameters[0], ROWS));
+            column = 0;
+        }
+        break;
+    case 'c': // DA - Device Attributes
+        report("\033[?1;c");
+        break;
+    case 'd': // VPA - Vertical Position Absolute
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        row = MIN(parameters[0] - 1, max_row);
+        break;
+    case 'e': // VPR - Vertical Position Relative
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to 1 if not specified
+        }
+        row = MIN(row + parameters[0], max_row);
+        break;
+    case 'g': // TBC – Tabulation Clear
+        if (parameters[0] == 3)
+        {
+            // Clear all tab stops
+            memset(tab_stops, 0, sizeof(tab_stops));
+        }
+        else if (parameters[0] == 0)
+        {
+            // Clear tab stop at current column
+            if (column < sizeof(tab_stops))
+            {
+                tab_stops[column] = false;
+            }
+        }
+        break;
+    case 'l': // RM – Reset Mode
+    case 'h': // SM – Set Mode
+        break;
+    case 'm': // SGR – Select Graphic Rendition
+        select_graphic_rendition(parameters, p_index + 1);
+        break;
+    case 'n':                   // Device Status Report
+        if (parameters[0] == 5) // DSR - Device Status Report
+        {
+            report("\033[0n");
+        }
+        else if (parameters[0] == 6) // DSR - Device Status Report
+        {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "\033[%d;%dR", row + 1, column + 1);
+            report(buf);
+        }
+        break;
+    case 'q': // DECLL – Load LEDS (DEC Private)
+        for (uint8_t i = 0; i <= p_index; i++)
+        {
+            if (parameters[i] == 0) // turn off all LEDs
+            {
+                leds = 0; // reset LED state
+            }
+            else if (parameters[i] > 0 && parameters[i] <= 8)
+            {
+                leds |= (1 << (parameters[i] - 1));
+            }
+        }
+        update_leds(leds); // update the LEDs
+        break;
+    case 'r': // DECSTBM – Set Top and Bottom Margins
+        if (parameters[0] == 0)
+        {
+            parameters[0] = 1; // default to the first row if not specified
+        }
+        if (parameters[1] == 0)
+        {
+            parameters[1] = ROWS; // default to the last row if not specified
+        }
+        uint8_t top_row = MIN(parameters[0] - 1, max_row);
+        uint8_t bottom_row = MIN(parameters[1] - 1, max_row);
+        if (bottom_row > top_row) // otherwise the margins are ignored
+        {
+            // The rows outside the margins are fixed areas of the display
+            scroll_top = top_row;
+            scroll_bottom = bottom_row;
+            lcd_define_scrolling(top_row * GLYPH_HEIGHT, (max_row - bottom_row) * GLYPH_HEIGHT);
+            display_redraw(); // the scroll offset was reset under the cells
+            row = top_row;
+            column = 0;
+        }
+        break;
+    case 's': // DECSC – Save Cursor (ANSI)
+        save_column = column;
+        save_row = row;
+        break;
+    case 't': // - Lines per page
+        // Not supported, ignore
+        break;
+    case 'u': // DECRC – Restore Cursor (ANSI)
+        column = save_column;
+        row = save_row;
+        break;
+    default:
+        put_cell(column++, row, 0x02); // print a error character
+        break;                         // ignore unknown sequences
+    }
+}
+
+// Dispatch the final character of a DEC private mode sequence
+static void dec_dispatch(char ch)
+{
+    switch (ch)
+    {
+    case 'h':                    // DECSET - DEC Private Mode Set
+        if (parameters[0] == 25) // DECTCEM - Text Cursor Enable Mode
+        {
+            lcd_enable_cursor(true);
+            lcd_draw_cursor();
+        }
+        else if (parameters[0] == 4264)
+        {
+            // set 64 column mode
+            lcd_set_font(&font_5x10);
+            display_redraw();
+        }
+        else if (parameters[0] == 47 || parameters[0] == 1047) // use the alternate screen
+        {
+            select_screen(true, parameters[0] == 1047);
+        }
+        else if (parameters[0] == 1049) // save the cursor and use a clear alternate screen
+        {
+            save_column = column;
+            save_row = row;
+            select_screen(true, true);
+        }
+        else if (parameters[0] == 2026) // start a synchronized update
+        {
+            begin_synchronized();
+        }
+        break;
+    case 'l':                    // DECRST - DEC Private Mode Reset
+        if (parameters[0] == 25) // DECTCEM - Text Cursor Enable Mode
+        {
+            lcd_enable_cursor(false);
+            lcd_erase_cursor(); // immediately hide cursor
+        }
+        else if (parameters[0] == 4264)
+        {
+            // set 40 column mode
+            lcd_set_font(&font_8x10);
+            display_redraw();
+        }
+        else if (parameters[0] == 47 || parameters[0] == 1047) // use the main screen
+        {
+            select_screen(false, false);
+        }
+        else if (parameters[0] == 1049) // use the main screen and restore the cursor
+        {
+            select_screen(false, false);
+            column = save_column;
+            row = save_row;
+        }
+        else if (parameters[0] == 2026) // end a synchronized update
+        {
+            end_synchronized();
+        }
+        break;
+    case 'm':
+        // Ignore for now
+        break;
+    default:
+        put_cell(column++, row, 0x01); // print a error character
+        break;                         // ignore unknown DEC private mode sequences
+    }
+}
+
+// DECRQM – Request Mode (DEC Private), reports whether a mode is set (1), reset (2) or
+// not recognised (0)
+static void dec_request_mode(char ch)
+{
+    uint8_t mode_state = 0;
+    char buf[24];
+
+    if (ch != 'p')
+    {
+        return;
+    }
+
+    if (parameters[0] == 25) // DECTCEM - Text Cursor Enable Mode
+    {
+        mode_state = lcd_cursor_enabled() ? 1 : 2;
+    }
+    else if (parameters[0] == 47 || parameters[0] == 1047 || parameters[0] == 1049) // alternate screen
+    {
+        mode_state = screen == alternate_screen ? 1 : 2;
+    }
+    else if (parameters[0] == 2026) // synchronized update
+    {
+        mode_state = synchronized ? 1 : 2;
+    }
+
+    snprintf(buf, sizeof(buf), "\033[?%d;%d$y", parameters[0], mode_state);
+    report(buf);
+}
+
+// Run a character through the state machine, updating the cells
+static void process_char(char ch)
+{
+    uint8_t transition = transitions[state][char_classes[(uint8_t)ch]];
+    state = transition & 0x0F;
+
+    switch (transition >> 4)
+    {
+    case ACTION_PRINT:
+        // Translate character based on active character set
+        put_cell(column++, row, translate_char(get_charset(), ch));
+        break;
+    case ACTION_EXECUTE:
+        execute_control(ch);
+        break;
+    case ACTION_CANCEL:
+        put_cell(column++, row, 0x02); // print a error character
+        break;
+    case ACTION_ESC_DISPATCH:
+        esc_dispatch(ch);
+        break;
+    case ACTION_CLEAR:
+        p_index = 0;
+        memset(parameters, 0, sizeof(parameters));
+        break;
+    case ACTION_PARAM:
+        parameters[p_index] = parameters[p_index] * 10 + (ch - '0'); // accumulate digits
+        break;
+    case ACTION_NEXT_PARAM:
+        if (p_index < count_of(parameters) - 1)
+        {
+            p_index++;
+        }
+        break;
+    case ACTION_CSI_DISPATCH:
+        csi_dispatch(ch);
+        break;
+    case ACTION_DEC_DISPATCH:
+        dec_dispatch(ch);
+        break;
+    case ACTION_DEC_REQUEST:
+        dec_request_mode(ch);
+        break;
+    case ACTION_TMC_DISPATCH:
+        if (ch == 'p') // Soft reset
+        {
+            reset_terminal();
+        }
+        break;
+    case ACTION_G0_DESIGNATE:
+        designate_charset(G0_CHARSET, ch);
+        break;
+    case ACTION_G1_DESIGNATE:
+        designate_charset(G1_CHARSET, ch);
+        break;
+    default:
+        break; // ACTION_NONE
+    }
+
+    // Handle wrapping and scrolling
+    if (column > lcd_get_columns() - 1) // wrap around at end of the line
+    {
+        column = 0;
+        line_feed();
+    }
+}
+
+// Run a complete control sequence at the start of the buffer without the state machine.
+// The parameters are read straight from the buffer and the common sequences (SGR, CUP and
+// EL) are carried out directly. Returns the number of characters used, or zero to leave
+// the sequence to the state machine.
+static int process_control_sequence(const char *buf, int length)
+{
+    uint16_t params[count_of(parameters)] = {0};
+    uint8_t count = 0;
+    int i = 2; // after ESC [
+
+    while (i < length)
+    {
+        char ch = buf[i];
+        if (ch >= '0' && ch <= '9')
+        {
+            params[count] = params[count] * 10 + (ch - '0'); // accumulate digits
+        }
+        else if (ch == ';') // delimiter
+        {
+            if (count < count_of(params) - 1)
+            {
+                count++;
+            }
+        }
+        else
+        {
+            break;
+        }
+        i++;
+    }
+
+    if (i == length)
+    {
+        return 0; // the sequence continues in the next buffer
+    }
+
+    switch (buf[i])
+    {
+    case 'm': // SGR – Select Graphic Rendition
+        select_graphic_rendition(params, count + 1);
+        break;
+    case 'H': // CUP – Cursor Position
+    case 'f': // HVP – Horizontal and Vertical Position
+        cursor_position(params[0], params[1]);
+        break;
+    case 'K': // EL – Erase In Line
+        erase_in_line(params[0]);
+        break;
+    default:
+        return 0;
+    }
+
+    return i + 1;
+}
+
+// Write a run of printable characters in the normal state straight to the cells
+static int process_printable(const char *buf, int length)
+{
+    uint8_t charset = get_charset();
+    uint8_t max_col = lcd_get_columns() - 1;
+    int i = 0;
+
+    while (i < length && buf[i] >= 0x20 && buf[i] < 0x7F)
+    {
+        put_cell(column++, row, translate_char(charset, buf[i++]));
+
+        if (column > max_col) // wrap around at end of the line
+        {
+            column = 0;
+            line_feed();
+        }
+    }
+
+    return i;
+}
+
+void display_emit_buffer(const char *buf, int length)
+{
+    display_review_end(); // new output returns to the live screen
+
+    if (synchronized && absolute_time_diff_us(sync_start, get_absolute_time()) > DISPLAY_SYNC_TIMEOUT_MS * 1000)
+    {
+        end_synchronized(); // do not hold back drawing for a program that never ends the update
+    }
+
+    lcd_erase_cursor(); // erase the cursor before processing the characters
+
+    int i = 0;
+    while (i < length)
+    {
+        if (state == STATE_NORMAL && buf[i] >= 0x20 && buf[i] < 0x7F)
+        {
+            i += process_printable(buf + i, length - i);
+            continue;
+        }
+
+        int used = 0;
+        if (state == STATE_NORMAL && buf[i] == CHR_ESC && i + 1 < length && buf[i + 1] == '[')
+        {
+            used = process_control_sequence(buf + i, length - i);
+        }
+
+        if (used > 0)
+        {
+            i += used;
+        }
+        else
+        {
+            process_char(buf[i++]);
+        }
+    }
+
+    // Draw the cells that changed, coalesced over the whole buffer
+    render_dirty();
+
+    // Update cursor position
+    lcd_move_cursor(column, row);
+    if (!synchronized)
+    {
+        lcd_draw_cursor(); // draw the cursor at the new position
+    }
+}
+
+void display_emit(char ch)
+{
+    display_emit_buffer(&ch, 1);
+}
+
+//
+//  Display Callback Setters
+//
+
+void display_set_led_callback(led_callback_t callback)
+{
+    display_led_callback = callback;
+}
+
+void display_set_bell_callback(bell_callback_t callback)
+{
+    display_bell_callback = callback;
+}
+
+void display_set_report_callback(report_callback_t callback)
+{
+    display_report_callback = callback;
+}
+
+//
+//  Display Initialization
+//
+
+void display_init()
+{
+    // Make sure the LCD is initialized
+    lcd_init();
+
+    // Start with a blank screen
+    apply_pen();
+    clear_cells();
 
     // Set tab stops every 8 columns by default
     for (int i = 3; i < 64; i += 8)
@@ -14,6 +14,45 @@
 #define STATE_OSC       (6)             // Operating System Command (OSC)
 #define STATE_OSC_ESC   (7)             // Operating System Command (OSC) ESC
 #define STATE_TMC       (8)             // Terminal Management Control (TMC)
+#define STATE_DEC_REQUEST (9)           // DEC private mode request ($)
+#define STATE_COUNT     (10)            // number of states
+
+// The characters are sorted into classes that drive the transitions
+// between the states.
+#define CLASS_CONTROL   (0)             // control characters not listed below
+#define CLASS_BEL       (1)             // bell (ends an OSC)
+#define CLASS_CANCEL    (2)             // CAN and SUB
+#define CLASS_ESC       (3)             // escape
+#define CLASS_DIGIT     (4)             // 0-9
+#define CLASS_SEPARATOR (5)             // ;
+#define CLASS_PRIVATE   (6)             // ?
+#define CLASS_BANG      (7)             // !
+#define CLASS_CSI       (8)             // [
+#define CLASS_STRING    (9)             // ] X ^ _ P (start a string)
+#define CLASS_G0        (10)            // (
+#define CLASS_G1        (11)            // )
+#define CLASS_BACKSLASH (12)            // \ (ends a string after ESC)
+#define CLASS_PRINT     (13)            // other printable characters
+#define CLASS_OTHER     (14)            // DEL and 8-bit characters
+#define CLASS_DOLLAR    (15)            // $
+#define CLASS_ST        (16)            // string terminator (8-bit)
+#define CLASS_COUNT     (17)            // number of classes
+
+// Each transition has an action, carried out after moving to the next state
+#define ACTION_NONE         (0)         // nothing to do
+#define ACTION_PRINT        (1)         // print the character
+#define ACTION_EXECUTE      (2)         // execute a control character
+#define ACTION_CANCEL       (3)         // cancel the sequence with an error character
+#define ACTION_ESC_DISPATCH (4)         // carry out an escape sequence
+#define ACTION_CLEAR        (5)         // clear the parameters
+#define ACTION_PARAM        (6)         // add a digit to the parameter
+#define ACTION_NEXT_PARAM   (7)         // move to the next parameter
+#define ACTION_CSI_DISPATCH (8)         // carry out a control sequence
+#define ACTION_DEC_DISPATCH (9)         // carry out a DEC private mode sequence
+#define ACTION_TMC_DISPATCH (10)        // carry out a terminal management control
+#define ACTION_G0_DESIGNATE (11)        // designate the G0 character set
+#define ACTION_G1_DESIGNATE (12)        // designate the G1 character set
+#define ACTION_DEC_REQUEST  (13)        // report a DEC private mode
 
 // Control characters
 #define CHR_BEL         (0x07)          // Bell
@@ -37,6 +76,23 @@
 #define G0_CHARSET      (0)             // G0 character set
 #define G1_CHARSET      (1)             // G0 and G1 character sets
 
+// Screen model
+#define DISPLAY_COLUMNS (64)            // most columns on the screen (narrowest font)
+#define DISPLAY_SCROLLBACK_SIZE (16384) // bytes of scrollback (power of 2)
+#define DISPLAY_REVIEW_PAGE (16)        // lines moved by a review key
+#define DISPLAY_SYNC_TIMEOUT_MS (500)   // longest a synchronized update holds back drawing
+#define CELL_BOLD       (0x01)          // cell is drawn bold
+#define CELL_UNDERSCORE (0x02)          // cell is drawn underscored
+
+// A character cell on the screen, the colours are after reverse video is applied
+typedef struct
+{
+    uint8_t glyph;                      // glyph (font offset)
+    uint8_t attributes;                 // CELL_BOLD and CELL_UNDERSCORE
+    uint16_t foreground;                // foreground colour (RGB565)
+    uint16_t background;                // background colour (RGB565)
+} display_cell_t;
+
 // Defaults
 #define WHITE_PHOSPHOR  RGB(216, 240, 255)  // white phosphor
 #define GREEN_PHOSPHOR  RGB(51, 255, 102)   // green phosphor
@@ -62,4 +118,10 @@ void display_set_led_callback(led_callback_t callback);
 void display_set_bell_callback(bell_callback_t callback);
 void display_set_report_callback(report_callback_t callback);
 bool display_emit_available(void);
-void display_emit(char c);
\ No newline at end of file
+void display_emit(char c);
+void display_emit_buffer(const char *buf, int length);
+void display_redraw(void);
+void display_review(int lines);
+void display_review_end(void);
+bool display_is_reviewing(void);
+void display_get_scrollback_stats(uint32_t *lines, uint32_t *bytes);
\ No newline at end of file
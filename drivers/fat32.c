@@ -30,6 +30,15 @@
         }                            \
     }
 
+#define CLEANUP_ON_ERROR(expr)  \
+    {                           \
+        result = (expr);        \
+        if (result != FAT32_OK) \
+        {                       \
+            goto cleanup;       \
+        }                       \
+    }
+
 #define CLOSE_AND_RETURN_ON_ERROR(expr) \
     {                                   \
         fat32_error_t _res = (expr);    \
@@ -61,6 +70,32 @@ static uint32_t current_dir_cluster = 0; // Current directory cluster
 static uint8_t sector_buffer[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
 static fat32_lfn_entry_t lfn_buffer[MAX_LFN_PART]; // Buffer for long file name entries
 
+// FAT sector cache, kept apart from sector_buffer so chain walks do not
+// evict the data sector being worked on
+typedef struct
+{
+    uint32_t sector;    // FAT sector held in this way
+    uint32_t last_used; // Tick of the last access, for LRU replacement
+    bool valid;
+    bool dirty;         // Modified since it was read from the card
+    uint8_t *data;      // This way's row of fat_cache_data
+} fat_cache_entry_t;
+
+static fat_cache_entry_t fat_cache[FAT32_FAT_CACHE_WAYS];
+static uint8_t fat_cache_data[FAT32_FAT_CACHE_WAYS][FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+static uint32_t fat_cache_tick = 0;
+static uint32_t fat_cache_hits = 0;
+static uint32_t fat_cache_misses = 0;
+
+// Free cluster map: the number of free entries in each FAT sector, built at
+// mount so that allocation and free space queries do not scan the card
+#define FAT_ENTRIES_PER_SECTOR (FAT32_SECTOR_SIZE / 4)
+
+static uint8_t free_map[FAT32_FREE_MAP_SECTORS];
+static uint32_t free_map_sectors = 0; // FAT sectors covered by the map
+static uint32_t free_map_total = 0;   // Free clusters on the volume
+static bool free_map_valid = false;   // False if the FAT is too large for the map
+
 // Timer for SD card detection
 static repeating_timer_t sd_card_detect_timer;
 
@@ -83,6 +118,191 @@ static inline fat32_error_t write_sector(uint32_t sector, const uint8_t *buffer)
     return sd_write_block(volume_start_block + sector, buffer);
 }
 
+static inline fat32_error_t read_sectors(uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    return sd_read_blocks(volume_start_block + sector, count, buffer);
+}
+
+static inline fat32_error_t write_sectors(uint32_t sector, uint32_t count, const uint8_t *buffer)
+{
+    return sd_write_blocks(volume_start_block + sector, count, buffer);
+}
+
+//
+//  FAT sector cache functions
+//
+
+static fat32_error_t fat_cache_write_back(fat_cache_entry_t *entry)
+{
+    if (entry->valid && entry->dirty)
+    {
+        RETURN_ON_ERROR(write_sector(entry->sector, entry->data));
+        entry->dirty = false;
+    }
+    return FAT32_OK;
+}
+
+// Write all modified FAT sectors back to the card
+static fat32_error_t fat_cache_flush(void)
+{
+    for (int i = 0; i < FAT32_FAT_CACHE_WAYS; i++)
+    {
+        RETURN_ON_ERROR(fat_cache_write_back(&fat_cache[i]));
+    }
+    return FAT32_OK;
+}
+
+// Forget all cached FAT sectors without writing them back
+static void fat_cache_invalidate(void)
+{
+    for (int i = 0; i < FAT32_FAT_CACHE_WAYS; i++)
+    {
+        fat_cache[i].valid = false;
+        fat_cache[i].dirty = false;
+        fat_cache[i].last_used = 0;
+    }
+}
+
+static fat32_error_t fat_cache_load(uint32_t sector, fat_cache_entry_t **result)
+{
+    fat_cache_entry_t *victim = &fat_cache[0];
+
+    for (int i = 0; i < FAT32_FAT_CACHE_WAYS; i++)
+    {
+        fat_cache_entry_t *entry = &fat_cache[i];
+        if (entry->valid && entry->sector == sector)
+        {
+            fat_cache_hits++;
+            entry->last_used = ++fat_cache_tick;
+            *result = entry;
+            return FAT32_OK;
+        }
+        if (entry->last_used < victim->last_used)
+        {
+            victim = entry; // Least recently used (invalid ways are never used)
+        }
+    }
+
+    fat_cache_misses++;
+
+    // Evict the least recently used way, writing it back if modified
+    RETURN_ON_ERROR(fat_cache_write_back(victim));
+    victim->valid = false;
+    victim->last_used = 0;
+    victim->data = fat_cache_data[victim - fat_cache];
+    RETURN_ON_ERROR(read_sector(sector, victim->data));
+
+    victim->sector = sector;
+    victim->valid = true;
+    victim->last_used = ++fat_cache_tick;
+    *result = victim;
+    return FAT32_OK;
+}
+
+//
+//  Free cluster map functions
+//
+
+// Count the free entries in one FAT sector of the mount-time scan
+static void free_map_count_sector(uint32_t sector, const uint8_t *data, void *param)
+{
+    const uint32_t *entries = (const uint32_t *)data;
+    uint32_t first_cluster = sector * FAT_ENTRIES_PER_SECTOR;
+    uint8_t free_entries = 0;
+
+    for (uint32_t j = 0; j < FAT_ENTRIES_PER_SECTOR; j++)
+    {
+        uint32_t cluster = first_cluster + j;
+        if (cluster >= 2 && cluster < cluster_count + 2 &&
+            (entries[j] & 0x0FFFFFFF) == FAT32_FAT_ENTRY_FREE)
+        {
+            free_entries++;
+        }
+    }
+    free_map[sector] = free_entries;
+    free_map_total += free_entries;
+}
+
+static fat32_error_t free_map_build(void)
+{
+    free_map_valid = false;
+    free_map_total = 0;
+
+    // The FAT sectors holding entries for clusters 2 to cluster_count + 1
+    free_map_sectors = (cluster_count + 1) / FAT_ENTRIES_PER_SECTOR + 1;
+    if (free_map_sectors > FAT32_FREE_MAP_SECTORS || free_map_sectors > boot_sector.fat_size_32)
+    {
+        return FAT32_OK; // Too large for the map, allocation will scan the FAT
+    }
+
+    // Stream the whole FAT under one command, counting each sector as it arrives
+    RETURN_ON_ERROR(fat_cache_flush()); // the FAT on the card must be current
+    RETURN_ON_ERROR(sd_read_blocks_each(volume_start_block + boot_sector.reserved_sectors, free_map_sectors,
+                                        sector_buffer, free_map_count_sector, NULL));
+
+    free_map_valid = true;
+    return FAT32_OK;
+}
+
+// Keep the map in step with a FAT entry changing from old_value to new_value
+static inline void free_map_update(uint32_t cluster, uint32_t old_value, uint32_t new_value)
+{
+    if (!free_map_valid)
+    {
+        return;
+    }
+
+    if (old_value == FAT32_FAT_ENTRY_FREE && new_value != FAT32_FAT_ENTRY_FREE)
+    {
+        free_map[cluster / FAT_ENTRIES_PER_SECTOR]--;
+        free_map_total--;
+    }
+    else if (old_value != FAT32_FAT_ENTRY_FREE && new_value == FAT32_FAT_ENTRY_FREE)
+    {
+        free_map[cluster / FAT_ENTRIES_PER_SECTOR]++;
+        free_map_total++;
+    }
+}
+
+// Find the first free cluster at or after start_cluster, wrapping around.
+// Only FAT sectors the map says have a free entry are read.
+static fat32_error_t free_map_find(uint32_t start_cluster, uint32_t *cluster)
+{
+    if (free_map_total == 0)
+    {
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    uint32_t start_sector = start_cluster / FAT_ENTRIES_PER_SECTOR;
+
+    // The start sector is visited twice: first from start_cluster, then in full
+    for (uint32_t i = 0; i <= free_map_sectors; i++)
+    {
+        uint32_t sector = (start_sector + i) % free_map_sectors;
+        if (free_map[sector] == 0)
+        {
+            continue;
+        }
+
+        fat_cache_entry_t *cached;
+        RETURN_ON_ERROR(fat_cache_load(boot_sector.reserved_sectors + sector, &cached));
+        const uint32_t *entries = (const uint32_t *)cached->data;
+
+        for (uint32_t j = 0; j < FAT_ENTRIES_PER_SECTOR; j++)
+        {
+            uint32_t candidate = sector * FAT_ENTRIES_PER_SECTOR + j;
+            if (candidate >= 2 && candidate < cluster_count + 2 &&
+                (i > 0 || candidate >= start_cluster) &&
+                (entries[j] & 0x0FFFFFFF) == FAT32_FAT_ENTRY_FREE)
+            {
+                *cluster = candidate;
+                return FAT32_OK;
+            }
+        }
+    }
+    return FAT32_ERROR_DISK_FULL;
+}
+
 //
 // FAT32 file system functions
 //
@@ -174,6 +394,11 @@ static fat32_error_t is_valid_fat32_boot_sector(const fat32_boot_sector_t *bs)
 
 static fat32_error_t update_fsinfo()
 {
+    if (free_map_valid)
+    {
+        fsinfo.free_count = free_map_total; // The map is exact
+    }
+
     // Write the updated FSInfo sector back to disk
     return write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo);
 }
@@ -190,10 +415,11 @@ static fat32_error_t read_cluster_fat_entry(uint32_t cluster, uint32_t *value)
     uint32_t fat_sector = boot_sector.reserved_sectors + (fat_offset / FAT32_SECTOR_SIZE);
     uint32_t entry_offset = fat_offset % FAT32_SECTOR_SIZE;
 
-    // Read the FAT sector
-    RETURN_ON_ERROR(read_sector(fat_sector, sector_buffer));
+    // Get the FAT sector from the cache
+    fat_cache_entry_t *cached;
+    RETURN_ON_ERROR(fat_cache_load(fat_sector, &cached));
 
-    uint32_t entry = *(uint32_t *)(sector_buffer + entry_offset);
+    uint32_t entry = *(uint32_t *)(cached->data + entry_offset);
     *value = entry & 0x0FFFFFFF; // Mask out upper 4 bits for FAT32
     return FAT32_OK;
 }
@@ -210,15 +436,15 @@ static fat32_error_t write_cluster_fat_entry(uint32_t cluster, uint32_t value)
     uint32_t fat_sector = boot_sector.reserved_sectors + (fat_offset / FAT32_SECTOR_SIZE);
     uint32_t entry_offset = fat_offset % FAT32_SECTOR_SIZE;
 
-    // Read the FAT sector
-    RETURN_ON_ERROR(read_sector(fat_sector, sector_buffer));
-
-    // Write the FAT entry
-    *(uint32_t *)(sector_buffer + entry_offset) &= 0xF0000000;
-    *(uint32_t *)(sector_buffer + entry_offset) |= value & 0x0FFFFFFF;
+    // Get the FAT sector from the cache
+    fat_cache_entry_t *cached;
+    RETURN_ON_ERROR(fat_cache_load(fat_sector, &cached));
 
-    // Write the modified sector back
-    RETURN_ON_ERROR(write_sector(fat_sector, sector_buffer));
+    // Write the FAT entry, the sector is written back on eviction or flush
+    free_map_update(cluster, *(uint32_t *)(cached->data + entry_offset) & 0x0FFFFFFF, value & 0x0FFFFFFF);
+    *(uint32_t *)(cached->data + entry_offset) &= 0xF0000000;
+    *(uint32_t *)(cached->data + entry_offset) |= value & 0x0FFFFFFF;
+    cached->dirty = true;
 
     return FAT32_OK;
 }
@@ -226,17 +452,31 @@ static fat32_error_t write_cluster_fat_entry(uint32_t cluster, uint32_t value)
 static fat32_error_t get_next_free_cluster(uint32_t *cluster)
 {
     // Start searching from next free or first data cluster
-    uint32_t start_cluster = fsinfo.next_free != 0xFFFFFFFF ? fsinfo.next_free : 2;
+    uint32_t start_cluster = fsinfo.next_free >= 2 && fsinfo.next_free < cluster_count + 2 ? fsinfo.next_free : 2;
 
-    // Iterate through the FAT to find a free cluster
-    for (uint32_t i = start_cluster; i < cluster_count + 2; i++)
+    if (free_map_valid)
     {
+        RETURN_ON_ERROR(free_map_find(start_cluster, cluster));
+        fsinfo.next_free = *cluster + 1; // Hint for the next search
+        return FAT32_OK;
+    }
+
+    // Iterate through the FAT to find a free cluster, wrapping around to the start
+    for (uint32_t n = 0; n < cluster_count; n++)
+    {
+        uint32_t i = start_cluster + n;
+        if (i >= cluster_count + 2)
+        {
+            i -= cluster_count;
+        }
+
         uint32_t value;
         RETURN_ON_ERROR(read_cluster_fat_entry(i, &value));
 
         if (value == FAT32_FAT_ENTRY_FREE)
         {
             *cluster = i;
+            fsinfo.next_free = i + 1; // Hint for the next search
             return FAT32_OK; // Found a free cluster
         }
     }
@@ -273,24 +513,13 @@ static fat32_error_t release_cluster_chain(uint32_t start_cluster)
     {
         fsinfo.next_free = lowest_cluster; // Update next free cluster if needed
     }
-    // Write the updated FSInfo sector back to disk
-    RETURN_ON_ERROR(write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo));
+    // Write the updated FSInfo sector and the freed FAT entries back to disk
+    RETURN_ON_ERROR(update_fsinfo());
+    RETURN_ON_ERROR(fat_cache_flush());
 
     return FAT32_OK;
 }
 
-static fat32_error_t find_last_cluster(uint32_t start_cluster, uint32_t count, uint32_t *last_cluster)
-{
-    *last_cluster = start_cluster;
-    for (uint32_t i = 1; i < count; i++)
-    {
-        uint32_t next_cluster;
-        RETURN_ON_ERROR(read_cluster_fat_entry(*last_cluster, &next_cluster));
-        *last_cluster = next_cluster;
-    }
-    return FAT32_OK;
-}
-
 static fat32_error_t allocate_and_link_cluster(uint32_t last_cluster, uint32_t *new_cluster)
 {
     RETURN_ON_ERROR(get_next_free_cluster(new_cluster));
@@ -306,6 +535,94 @@ static fat32_error_t allocate_and_link_cluster(uint32_t last_cluster, uint32_t *
     return FAT32_OK;
 }
 
+// Find a run of free clusters for an allocation of count clusters, searching
+// from hint and wrapping around. Returns the first run that is long enough,
+// otherwise the longest run seen. FAT sectors the free map reports as all
+// used or all free are not read.
+static fat32_error_t find_free_run(uint32_t hint, uint32_t count, uint32_t *run_start, uint32_t *run_length)
+{
+    uint32_t end_cluster = cluster_count + 2;
+    uint32_t best_start = 0;
+    uint32_t best_length = 0;
+    uint32_t start = 0;
+    uint32_t length = 0;
+
+    if (free_map_valid && free_map_total == 0)
+    {
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    uint32_t cluster = hint >= 2 && hint < end_cluster ? hint : 2;
+    uint32_t remaining = cluster_count;
+    while (remaining > 0 && best_length < count)
+    {
+        if (cluster >= end_cluster)
+        {
+            cluster = 2;
+            length = 0; // Runs do not wrap around
+        }
+
+        // The part of this FAT sector still to be searched
+        uint32_t sector = cluster / FAT_ENTRIES_PER_SECTOR;
+        uint32_t sector_first = MAX(sector * FAT_ENTRIES_PER_SECTOR, 2);
+        uint32_t sector_end = MIN((sector + 1) * FAT_ENTRIES_PER_SECTOR, end_cluster);
+        uint32_t span = MIN(sector_end - cluster, remaining);
+
+        if (free_map_valid && free_map[sector] == 0)
+        {
+            length = 0;
+        }
+        else if (free_map_valid && free_map[sector] == sector_end - sector_first)
+        {
+            if (length == 0)
+            {
+                start = cluster;
+            }
+            length += span;
+        }
+        else
+        {
+            for (uint32_t i = 0; i < span && best_length < count; i++)
+            {
+                uint32_t value;
+                RETURN_ON_ERROR(read_cluster_fat_entry(cluster + i, &value));
+                if (value != FAT32_FAT_ENTRY_FREE)
+                {
+                    length = 0;
+                    continue;
+                }
+                if (length == 0)
+                {
+                    start = cluster + i;
+                }
+                length++;
+                if (length > best_length)
+                {
+                    best_start = start;
+                    best_length = length;
+                }
+            }
+        }
+
+        if (length > best_length)
+        {
+            best_start = start;
+            best_length = length;
+        }
+        cluster += span;
+        remaining -= span;
+    }
+
+    if (best_length == 0)
+    {
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    *run_start = best_start;
+    *run_length = best_length;
+    return FAT32_OK;
+}
+
 static fat32_error_t clear_cluster(uint32_t cluster)
 {
     uint32_t sector = cluster_to_sector(cluster);
@@ -317,20 +634,209 @@ static fat32_error_t clear_cluster(uint32_t cluster)
     return FAT32_OK;
 }
 
-static fat32_error_t seek_to_cluster(uint32_t start_cluster, uint32_t offset, uint32_t *result_cluster)
+// Move the file's cluster cursor to the cluster holding the byte at position.
+// The cursor only walks forward from where it is; a backward move restarts
+// from the first cluster.
+static fat32_error_t seek_file_cluster(fat32_file_t *file, uint32_t position)
 {
-    uint32_t cluster = start_cluster;
-    for (uint32_t i = 0; i < offset; i++)
+    uint32_t index = position / bytes_per_cluster;
+
+    if (file->current_cluster < 2 || index < file->cluster_index)
+    {
+        file->current_cluster = file->start_cluster;
+        file->cluster_index = 0;
+    }
+
+    while (file->cluster_index < index)
     {
         uint32_t next_cluster;
-        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+        RETURN_ON_ERROR(read_cluster_fat_entry(file->current_cluster, &next_cluster));
         if (next_cluster >= FAT32_FAT_ENTRY_EOC)
         {
             return FAT32_ERROR_INVALID_POSITION;
         }
-        cluster = next_cluster;
+        file->current_cluster = next_cluster;
+        file->cluster_index++;
+    }
+    return FAT32_OK;
+}
+
+// Count the whole sectors, from sector_in_cluster of the cursor's cluster,
+// that can be moved with one multi-block command, up to max_sectors. The run
+// carries on into the following clusters while they sit next to each other
+// on the card, as they do in preallocated files. The cursor is moved to the
+// last cluster of the run so that the clusters are not walked again.
+static fat32_error_t contiguous_sectors(fat32_file_t *file, uint32_t sector_in_cluster, uint32_t max_sectors, uint32_t *count)
+{
+    uint32_t sectors = MIN(max_sectors, boot_sector.sectors_per_cluster - sector_in_cluster);
+
+    while (sectors < max_sectors)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(file->current_cluster, &next_cluster));
+        if (next_cluster != file->current_cluster + 1)
+        {
+            break;
+        }
+        file->current_cluster = next_cluster;
+        file->cluster_index++;
+        sectors += MIN(max_sectors - sectors, boot_sector.sectors_per_cluster);
+    }
+
+    *count = sectors;
+    return FAT32_OK;
+}
+
+// Zero the bytes of the file from start to end, which the cluster chain must
+// already cover, so that a file that grows does not show the old contents of
+// its clusters. The bytes before start in its sector are kept; the sector
+// holding end is zeroed to its end, as it is past the end of the file.
+static fat32_error_t zero_file_range(fat32_file_t *file, uint32_t start, uint32_t end)
+{
+    uint32_t byte_in_sector = start % FAT32_SECTOR_SIZE;
+    if (byte_in_sector != 0)
+    {
+        RETURN_ON_ERROR(seek_file_cluster(file, start));
+        uint32_t sector = cluster_to_sector(file->current_cluster) + (start % bytes_per_cluster) / FAT32_SECTOR_SIZE;
+        RETURN_ON_ERROR(read_sector(sector, sector_buffer));
+        memset(sector_buffer + byte_in_sector, 0, FAT32_SECTOR_SIZE - byte_in_sector);
+        RETURN_ON_ERROR(write_sector(sector, sector_buffer));
+
+        if (end - start <= FAT32_SECTOR_SIZE - byte_in_sector)
+        {
+            return FAT32_OK;
+        }
+        start += FAT32_SECTOR_SIZE - byte_in_sector;
+    }
+
+    uint32_t sectors = (end - start) / FAT32_SECTOR_SIZE + ((end - start) % FAT32_SECTOR_SIZE != 0);
+    memset(sector_buffer, 0, FAT32_SECTOR_SIZE);
+    for (uint32_t i = 0; i < sectors; i++, start += FAT32_SECTOR_SIZE)
+    {
+        RETURN_ON_ERROR(seek_file_cluster(file, start));
+        uint32_t sector = cluster_to_sector(file->current_cluster) + (start % bytes_per_cluster) / FAT32_SECTOR_SIZE;
+        RETURN_ON_ERROR(write_sector(sector, sector_buffer));
+    }
+    return FAT32_OK;
+}
+
+// Link free clusters onto the end of the file's chain until it can hold size
+// bytes. Each contiguous run of free clusters is linked in one pass and
+// FSInfo is written once at the end. The cluster cursor is left alone. When
+// the volume fills up, the clusters already linked stay on the chain and
+// chain_clusters (if not NULL) says how many the chain now has.
+static fat32_error_t extend_cluster_chain(fat32_file_t *file, uint32_t size, uint32_t *chain_clusters)
+{
+    uint32_t needed = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t last_cluster = 0;
+    uint32_t clusters = 0;
+
+    if (file->start_cluster >= 2)
+    {
+        // Walk to the end of the chain, from the cursor if it is set
+        last_cluster = file->current_cluster >= 2 ? file->current_cluster : file->start_cluster;
+        clusters = (file->current_cluster >= 2 ? file->cluster_index : 0) + 1;
+        while (clusters < needed)
+        {
+            uint32_t next_cluster;
+            RETURN_ON_ERROR(read_cluster_fat_entry(last_cluster, &next_cluster));
+            if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+            {
+                break;
+            }
+            last_cluster = next_cluster;
+            clusters++;
+        }
+    }
+
+    if (clusters >= needed)
+    {
+        if (chain_clusters)
+        {
+            *chain_clusters = clusters;
+        }
+        return FAT32_OK; // Already large enough
+    }
+
+    fat32_error_t result = FAT32_OK;
+    while (clusters < needed)
+    {
+        // Prefer the clusters straight after the end of the file
+        bool empty_file = file->file_size == 0 && clusters == 1;
+        uint32_t run_start, run_length;
+        result = find_free_run(last_cluster ? last_cluster + 1 : fsinfo.next_free,
+                               empty_file ? needed : needed - clusters, &run_start, &run_length);
+        if (result != FAT32_OK)
+        {
+            break;
+        }
+
+        // An empty file gives up the cluster it was created with when
+        // a run elsewhere can hold the whole file
+        if (empty_file && run_start != last_cluster + 1 && run_length >= needed)
+        {
+            RETURN_ON_ERROR(write_cluster_fat_entry(last_cluster, FAT32_FAT_ENTRY_FREE));
+            if (fsinfo.free_count != 0xFFFFFFFF)
+            {
+                fsinfo.free_count++;
+            }
+            last_cluster = 0;
+            clusters = 0;
+        }
+        run_length = MIN(run_length, needed - clusters);
+
+        // Chain the run together, then hang it off the end of the file
+        for (uint32_t i = 1; i < run_length; i++)
+        {
+            RETURN_ON_ERROR(write_cluster_fat_entry(run_start + i - 1, run_start + i));
+        }
+        RETURN_ON_ERROR(write_cluster_fat_entry(run_start + run_length - 1, FAT32_FAT_ENTRY_EOC));
+
+        if (last_cluster)
+        {
+            RETURN_ON_ERROR(write_cluster_fat_entry(last_cluster, run_start));
+        }
+        else
+        {
+            file->start_cluster = run_start;
+            file->current_cluster = run_start;
+            file->cluster_index = 0;
+        }
+
+        if (fsinfo.free_count != 0xFFFFFFFF)
+        {
+            fsinfo.free_count -= run_length;
+        }
+        last_cluster = run_start + run_length - 1;
+        clusters += run_length;
+        fsinfo.next_free = last_cluster + 1;
+    }
+
+    if (chain_clusters)
+    {
+        *chain_clusters = clusters;
+    }
+
+    // One FSInfo update for the whole extension
+    RETURN_ON_ERROR(update_fsinfo());
+
+    return result;
+}
+
+// Write the file's first cluster and size to its directory entry
+static fat32_error_t update_dir_entry(fat32_file_t *file)
+{
+    if (file->dir_entry_sector && file->dir_entry_offset < FAT32_SECTOR_SIZE)
+    {
+        RETURN_ON_ERROR(read_sector(file->dir_entry_sector, sector_buffer));
+
+        fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + file->dir_entry_offset);
+        dir_entry->fst_clus_hi = file->start_cluster >> 16;
+        dir_entry->fst_clus_lo = file->start_cluster & 0xFFFF;
+        dir_entry->file_size = file->file_size;
+
+        RETURN_ON_ERROR(write_sector(file->dir_entry_sector, sector_buffer));
     }
-    *result_cluster = cluster;
     return FAT32_OK;
 }
 
@@ -409,7 +915,7 @@ fat32_error_t fat32_mount(void)
     // Calculate important sectors/clusters
     bytes_per_cluster = boot_sector.sectors_per_cluster * FAT32_SECTOR_SIZE;
     first_data_sector = boot_sector.reserved_sectors + (boot_sector.num_fats * boot_sector.fat_size_32);
-    data_region_sectors = boot_sector.total_sectors_32 - (boot_sector.num_fats * boot_sector.fat_size_32);
+    data_region_sectors = boot_sector.total_sectors_32 - first_data_sector;
     cluster_count = data_region_sectors / boot_sector.sectors_per_cluster;
     if (cluster_count < 65525)
     {
@@ -429,12 +935,23 @@ fat32_error_t fat32_mount(void)
         return FAT32_ERROR_INVALID_FORMAT; // FSInfo is not valid
     }
 
+    // Count the free clusters once, FSInfo is only a hint
+    RETURN_ON_ERROR(free_map_build());
+    if (free_map_valid)
+    {
+        fsinfo.free_count = free_map_total;
+    }
+
     fat32_mounted = true;
     return FAT32_OK;
 }
 
 void fat32_unmount(void)
 {
+    if (fat32_mounted && sd_card_present())
+    {
+        fat_cache_flush(); // Best effort, the card may be going away
+    }
     fat32_mounted = false;
     mount_status = FAT32_ERROR_NO_CARD;
     volume_start_block = 0;
@@ -443,6 +960,8 @@ void fat32_unmount(void)
     cluster_count = 0;
     bytes_per_cluster = 0;
     current_dir_cluster = 0;
+    fat_cache_invalidate();
+    free_map_valid = false;
 }
 
 bool fat32_is_mounted(void)
@@ -486,6 +1005,12 @@ fat32_error_t fat32_get_free_space(uint64_t *free_space)
         return mount_status;
     }
 
+    if (free_map_valid)
+    {
+        *free_space = ((uint64_t)free_map_total) * bytes_per_cluster;
+        return FAT32_OK; // Kept up to date since mount
+    }
+
     if (fsinfo.free_count != 0xFFFFFFFF &&
         fsinfo.free_count <= cluster_count)
     {
@@ -494,6 +1019,7 @@ fat32_error_t fat32_get_free_space(uint64_t *free_space)
     }
 
     // If FSInfo is not valid, we will count free clusters manually
+    RETURN_ON_ERROR(fat_cache_flush());
     uint64_t free_clusters = 0;
     for (uint32_t sector = 0; sector < boot_sector.fat_size_32; sector++)
     {
@@ -1258,6 +1784,7 @@ static fat32_error_t link_entry(fat32_entry_t *entry, const char *path)
     CLOSE_AND_RETURN_ON_ERROR(read_sector(entry->sector, sector_buffer));
     memcpy(sector_buffer + entry->offset, &dir_entry, sizeof(dir_entry));
     CLOSE_AND_RETURN_ON_ERROR(write_sector(entry->sector, sector_buffer));
+    CLOSE_AND_RETURN_ON_ERROR(fat_cache_flush());
 
     fat32_close(&dir);
 
@@ -1422,23 +1949,33 @@ fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *
         size = remaining;
     }
 
-    // Ensure current_cluster is correct for current file position
-    uint32_t cluster = 0;
-    uint32_t cluster_offset = file->position / bytes_per_cluster;
-    RETURN_ON_ERROR(seek_to_cluster(file->start_cluster, cluster_offset, &cluster));
-    file->current_cluster = cluster;
-
     size_t total_read = 0;
     uint8_t *dest = (uint8_t *)buffer;
 
     while (total_read < size)
     {
+        // Advance the cluster cursor, this is a no-op within a cluster
+        RETURN_ON_ERROR(seek_file_cluster(file, file->position));
+
         uint32_t cluster_offset = file->position % bytes_per_cluster;
         uint32_t sector_in_cluster = cluster_offset / FAT32_SECTOR_SIZE;
         uint32_t byte_in_sector = cluster_offset % FAT32_SECTOR_SIZE;
 
         uint32_t sector = cluster_to_sector(file->current_cluster) + sector_in_cluster;
 
+        // Whole sectors go straight into the caller's buffer, as many as
+        // are next to each other on the card in one command
+        if (byte_in_sector == 0 && size - total_read >= FAT32_SECTOR_SIZE)
+        {
+            uint32_t sectors;
+            RETURN_ON_ERROR(contiguous_sectors(file, sector_in_cluster, (size - total_read) / FAT32_SECTOR_SIZE, &sectors));
+            RETURN_ON_ERROR(read_sectors(sector, sectors, dest + total_read));
+            total_read += sectors * FAT32_SECTOR_SIZE;
+            file->position += sectors * FAT32_SECTOR_SIZE;
+            continue;
+        }
+
+        // Partial sectors are bounced through the sector buffer
         RETURN_ON_ERROR(read_sector(sector, sector_buffer));
 
         size_t bytes_to_copy = FAT32_SECTOR_SIZE - byte_in_sector;
@@ -1450,19 +1987,6 @@ fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *
         memcpy(dest + total_read, sector_buffer + byte_in_sector, bytes_to_copy);
         total_read += bytes_to_copy;
         file->position += bytes_to_copy;
-
-        // Check if we need to move to the next cluster
-        if ((file->position % bytes_per_cluster) == 0 && total_read < size)
-        {
-            uint32_t next_cluster;
-            RETURN_ON_ERROR(read_cluster_fat_entry(file->current_cluster, &next_cluster));
-            if (next_cluster >= FAT32_FAT_ENTRY_EOC)
-            {
-                // End of cluster chain or error
-                break;
-            }
-            file->current_cluster = next_cluster;
-        }
     }
 
     if (bytes_read)
@@ -1494,83 +2018,65 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
         *bytes_written = 0;
     }
 
-    uint32_t old_file_size = file->file_size;
-
-    // Ensure current_cluster is correct for current file position
-    uint32_t cluster = file->start_cluster;
-    uint32_t cluster_offset = file->position / bytes_per_cluster;
-    for (uint32_t i = 0; i < cluster_offset; i++)
-    {
-        uint32_t next_cluster;
-        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
-        if (next_cluster >= FAT32_FAT_ENTRY_EOC)
-        {
-            // Allocate a new cluster and link it
-            uint32_t new_cluster = 0;
-            RETURN_ON_ERROR(allocate_and_link_cluster(cluster, &new_cluster));
-            next_cluster = new_cluster;
-        }
-        cluster = next_cluster;
-    }
-    file->current_cluster = cluster;
-
+    fat32_error_t result = FAT32_OK;
     size_t total_written = 0;
     const uint8_t *src = (const uint8_t *)buffer;
+    size_t pos_in_file = file->position;
 
-    // Calculate how many clusters are needed for the write
-    uint32_t end_pos = file->position + size;
-    uint32_t needed_clusters = (end_pos + bytes_per_cluster - 1) / bytes_per_cluster;
-    uint32_t current_clusters = file->file_size == 0 ? 1 : (file->file_size + bytes_per_cluster - 1) / bytes_per_cluster;
-
-    // Find last cluster in chain
-    cluster = file->start_cluster;
-    uint32_t last_cluster = cluster;
-    if (current_clusters > 0)
-    {
-        RETURN_ON_ERROR(find_last_cluster(cluster, current_clusters, &last_cluster));
-    }
-
-    // Allocate clusters if needed
-    for (uint32_t i = current_clusters; i < needed_clusters; i++)
+    // Grow the cluster chain in one pass when writing past the end of the file
+    if (size > 0 && file->position + size > file->file_size)
     {
-        uint32_t new_cluster = 0;
-
-        if (current_clusters > 0 || i > 0)
+        uint32_t clusters = 0;
+        result = extend_cluster_chain(file, file->position + size, &clusters);
+        if (result == FAT32_ERROR_DISK_FULL)
         {
-            RETURN_ON_ERROR(allocate_and_link_cluster(last_cluster, &new_cluster));
+            // Write as much as the clusters that could be linked hold
+            uint64_t capacity = (uint64_t)clusters * bytes_per_cluster;
+            size = capacity > file->position ? MIN(size, capacity - file->position) : 0;
+            result = size > 0 ? FAT32_OK : FAT32_ERROR_DISK_FULL;
         }
-        else
-        {
-            // First cluster for empty file
-            RETURN_ON_ERROR(get_next_free_cluster(&new_cluster));
-            RETURN_ON_ERROR(write_cluster_fat_entry(new_cluster, FAT32_FAT_ENTRY_EOC));
-
-            if (fsinfo.free_count != 0xFFFFFFFF)
-            {
-                fsinfo.free_count--;
-                update_fsinfo();
-            }
+        CLEANUP_ON_ERROR(result);
 
-            file->start_cluster = new_cluster;
+        // A write that starts past the end of the file leaves a gap that reads as zeros
+        if (file->position > file->file_size)
+        {
+            CLEANUP_ON_ERROR(zero_file_range(file, file->file_size, file->position));
         }
-        last_cluster = new_cluster;
     }
 
-    // Find cluster for file->position
-    cluster = 0;
-    cluster_offset = file->position / bytes_per_cluster;
-    RETURN_ON_ERROR(seek_to_cluster(file->start_cluster, cluster_offset, &cluster));
-    file->current_cluster = cluster;
-
-    size_t pos_in_file = file->position;
     while (total_written < size)
     {
+        // Advance the cluster cursor, this is a no-op within a cluster
+        CLEANUP_ON_ERROR(seek_file_cluster(file, pos_in_file));
+
         uint32_t offset_in_cluster = pos_in_file % bytes_per_cluster;
         uint32_t sector_in_cluster = offset_in_cluster / FAT32_SECTOR_SIZE;
         uint32_t byte_in_sector = offset_in_cluster % FAT32_SECTOR_SIZE;
-        uint32_t sector = cluster_to_sector(cluster) + sector_in_cluster;
+        uint32_t sector = cluster_to_sector(file->current_cluster) + sector_in_cluster;
 
-        RETURN_ON_ERROR(read_sector(sector, sector_buffer));
+        // Whole sectors are written straight from the caller's buffer, with
+        // no read-modify-write, as many as are next to each other on the card
+        // in one command
+        if (byte_in_sector == 0 && size - total_written >= FAT32_SECTOR_SIZE)
+        {
+            uint32_t sectors;
+            CLEANUP_ON_ERROR(contiguous_sectors(file, sector_in_cluster, (size - total_written) / FAT32_SECTOR_SIZE, &sectors));
+            CLEANUP_ON_ERROR(write_sectors(sector, sectors, src + total_written));
+            total_written += sectors * FAT32_SECTOR_SIZE;
+            pos_in_file += sectors * FAT32_SECTOR_SIZE;
+            continue;
+        }
+
+        // Partial sectors are merged in the sector buffer, a sector that
+        // starts at or past the end of the file has nothing worth reading
+        if (pos_in_file - byte_in_sector >= file->file_size)
+        {
+            memset(sector_buffer, 0, FAT32_SECTOR_SIZE);
+        }
+        else
+        {
+            CLEANUP_ON_ERROR(read_sector(sector, sector_buffer));
+        }
 
         size_t bytes_to_write = FAT32_SECTOR_SIZE - byte_in_sector;
         if (bytes_to_write > size - total_written)
@@ -1580,23 +2086,10 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
 
         memcpy(sector_buffer + byte_in_sector, src + total_written, bytes_to_write);
 
-        RETURN_ON_ERROR(write_sector(sector, sector_buffer));
+        CLEANUP_ON_ERROR(write_sector(sector, sector_buffer));
 
         total_written += bytes_to_write;
         pos_in_file += bytes_to_write;
-
-        // Move to next cluster if needed
-        if ((pos_in_file % bytes_per_cluster) == 0 && total_written < size)
-        {
-            uint32_t next_cluster;
-            fat32_error_t fat_res = read_cluster_fat_entry(cluster, &next_cluster);
-            if (fat_res != FAT32_OK || next_cluster >= FAT32_FAT_ENTRY_EOC)
-            {
-                return FAT32_ERROR_DISK_FULL;
-            }
-            cluster = next_cluster;
-            file->current_cluster = cluster;
-        }
     }
 
     file->position = pos_in_file;
@@ -1610,54 +2103,114 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
         *bytes_written = total_written;
     }
 
-    // --- Truncate cluster chain if file shrank ---
-    if (file->file_size < old_file_size)
+cleanup:
+    // Write back the FAT sectors touched by this write, even if it failed
+    if (result == FAT32_OK)
     {
-        // Calculate clusters needed for new size
-        uint32_t needed_clusters = (file->file_size == 0) ? 0 : (file->file_size + bytes_per_cluster - 1) / bytes_per_cluster;
-        uint32_t current_clusters = (old_file_size == 0) ? 0 : (old_file_size + bytes_per_cluster - 1) / bytes_per_cluster;
+        result = fat_cache_flush();
+    }
+    else
+    {
+        fat_cache_flush(); // keep the first error
+    }
+    RETURN_ON_ERROR(result);
+
+    // Update directory entry file size on disk
+    return update_dir_entry(file);
+}
+
+fat32_error_t fat32_preallocate(fat32_file_t *file, uint32_t size)
+{
+    if (!file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    if (file->attributes & FAT32_ATTR_DIRECTORY)
+    {
+        return FAT32_ERROR_NOT_A_FILE; // Cannot preallocate a directory
+    }
+
+    if (!fat32_is_ready())
+    {
+        return mount_status;
+    }
+
+    // Write back the FAT sectors even if the chain could only be extended part way
+    fat32_error_t result = extend_cluster_chain(file, size, NULL);
+    fat32_error_t flush_result = fat_cache_flush();
+    RETURN_ON_ERROR(result);
+    RETURN_ON_ERROR(flush_result);
+
+    // The first cluster may be new
+    return update_dir_entry(file);
+}
 
-        if (needed_clusters < current_clusters && file->start_cluster >= 2)
+fat32_error_t fat32_truncate(fat32_file_t *file, uint32_t size)
+{
+    if (!file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    if (file->attributes & FAT32_ATTR_DIRECTORY)
+    {
+        return FAT32_ERROR_NOT_A_FILE; // Cannot truncate a directory
+    }
+
+    if (!fat32_is_ready())
+    {
+        return mount_status;
+    }
+
+    fat32_error_t result = FAT32_OK;
+    if (size > file->file_size)
+    {
+        // The new bytes read as zeros, the size only moves once they are
+        CLEANUP_ON_ERROR(extend_cluster_chain(file, size, NULL));
+        CLEANUP_ON_ERROR(zero_file_range(file, file->file_size, size));
+    }
+    else if (file->start_cluster >= 2)
+    {
+        if (size == 0)
         {
-            uint32_t last_cluster_to_keep = file->start_cluster;
-            if (needed_clusters > 0)
-            {
-                // Seek to last cluster to keep
-                fat32_error_t seek_res = seek_to_cluster(file->start_cluster, needed_clusters - 1, &last_cluster_to_keep);
-                if (seek_res == FAT32_OK)
-                {
-                    uint32_t first_cluster_to_free = 0;
-                    if (read_cluster_fat_entry(last_cluster_to_keep, &first_cluster_to_free) == FAT32_OK)
-                    {
-                        // Mark end of chain
-                        write_cluster_fat_entry(last_cluster_to_keep, FAT32_FAT_ENTRY_EOC);
-                        // Free the rest
-                        release_cluster_chain(first_cluster_to_free);
-                    }
-                }
-            }
-            else
+            // File is now empty, free entire chain
+            CLEANUP_ON_ERROR(release_cluster_chain(file->start_cluster));
+            file->start_cluster = 0;
+            file->current_cluster = 0;
+            file->cluster_index = 0;
+        }
+        else
+        {
+            // Cut the chain after the last cluster still needed, this also
+            // releases clusters preallocated past the end of the file
+            CLEANUP_ON_ERROR(seek_file_cluster(file, size - 1));
+
+            uint32_t first_cluster_to_free;
+            CLEANUP_ON_ERROR(read_cluster_fat_entry(file->current_cluster, &first_cluster_to_free));
+            if (first_cluster_to_free < FAT32_FAT_ENTRY_EOC)
             {
-                // File is now empty, free entire chain
-                release_cluster_chain(file->start_cluster);
-                file->start_cluster = 0;
+                CLEANUP_ON_ERROR(write_cluster_fat_entry(file->current_cluster, FAT32_FAT_ENTRY_EOC));
+                CLEANUP_ON_ERROR(release_cluster_chain(first_cluster_to_free));
             }
         }
     }
 
-    // Update directory entry file size on disk
-    // After updating file->file_size:
-    if (file->dir_entry_sector && file->dir_entry_offset < FAT32_SECTOR_SIZE)
-    {
-        RETURN_ON_ERROR(read_sector(file->dir_entry_sector, sector_buffer));
-
-        fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + file->dir_entry_offset);
-        dir_entry->file_size = file->file_size;
+    file->file_size = size;
 
-        RETURN_ON_ERROR(write_sector(file->dir_entry_sector, sector_buffer));
+cleanup:
+    // Write back the FAT sectors touched, even if it failed part way
+    if (result == FAT32_OK)
+    {
+        result = fat_cache_flush();
+    }
+    else
+    {
+        fat_cache_flush(); // keep the first error
     }
+    RETURN_ON_ERROR(result);
 
-    return FAT32_OK;
+    return update_dir_entry(file);
 }
 
 fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position)
@@ -2073,6 +2626,18 @@ fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path)
     return FAT32_OK;
 }
 
+void fat32_get_fat_cache_stats(uint32_t *hits, uint32_t *misses)
+{
+    if (hits)
+    {
+        *hits = fat_cache_hits;
+    }
+    if (misses)
+    {
+        *misses = fat_cache_misses;
+    }
+}
+
 const char *fat32_error_string(fat32_error_t error)
 {
     switch (error)
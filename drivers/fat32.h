@@ -5,6 +5,8 @@
 #define FAT32_MAX_FILENAME_LEN (255)
 #define FAT32_MAX_PATH_LEN (260)
 #define MAX_LFN_PART (20) // Maximum number of LFN parts (13 UTF-16 chars each)
+#define FAT32_FAT_CACHE_WAYS (4) // Number of FAT sectors cached in RAM
+#define FAT32_FREE_MAP_SECTORS (8192) // Largest FAT (in sectors) tracked by the free cluster map
 
 // File attributes
 #define FAT32_ATTR_READ_ONLY (0x01)
@@ -59,6 +61,7 @@ typedef struct
     uint8_t attributes;
     uint32_t start_cluster;
     uint32_t current_cluster;
+    uint32_t cluster_index;    // Index of current_cluster within the chain
     uint32_t file_size;
     uint32_t position;
     uint32_t dir_entry_sector; // Sector containing the directory entry
@@ -182,6 +185,8 @@ fat32_error_t fat32_create(fat32_file_t *file, const char *path);
 fat32_error_t fat32_close(fat32_file_t *file);
 fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
 fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written);
+fat32_error_t fat32_preallocate(fat32_file_t *file, uint32_t size);
+fat32_error_t fat32_truncate(fat32_file_t *file, uint32_t size);
 fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position);
 uint32_t fat32_tell(fat32_file_t *file);
 uint32_t fat32_size(fat32_file_t *file);
@@ -198,5 +203,6 @@ fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path);
 
 // Utility functions
 const char *fat32_error_string(fat32_error_t error);
+void fat32_get_fat_cache_stats(uint32_t *hits, uint32_t *misses);
 
 void fat32_init(void);
@@ -8,8 +8,9 @@
 //  The PicoCalc only allows for polling the keyboard, and the API is
 //  limited. To support user interrupts, we need to poll the keyboard and
 //  buffer the key events for when needed, except for the user interrupt
-//  where we process it immediately. We use a semaphore to protect access
-//  to the I2C bus and a repeating timer to poll for the key events.
+//  where we process it immediately. A repeating timer starts each poll,
+//  and the key events are read through the southbridge transfer queue,
+//  ahead of any other request.
 //
 //  We also provide functions to interact with other features in the system,
 //  such as reading the battery level.
@@ -30,102 +31,235 @@ static bool key_control = false; // control key state
 static bool key_shift = false;   // shift key state
 static bool key_alt = false;     // alt key state
 
-static volatile char rx_buffer[KBD_BUFFER_SIZE];
-static volatile uint16_t rx_head = 0;
-static volatile uint16_t rx_tail = 0;
+// Event queue, written by the poll and read by the caller
+static keyboard_event_t event_queue[KBD_EVENT_QUEUE_SIZE];
+static volatile uint32_t event_head = 0; // position after the newest event (poll)
+static volatile uint32_t event_tail = 0; // position of the oldest event (caller)
 static repeating_timer_t key_timer;
 
+// Event queue statistics
+static uint32_t events_queued = 0;  // events added to the queue
+static uint32_t events_dropped = 0; // events dropped because the queue was full
+static uint32_t events_deepest = 0; // most events waiting at once
+
+// Polling
+static uint32_t poll_interval_ms = KEYBOARD_POLL_MS; // current interval of the background poll
+static uint32_t poll_last_us = 0;                    // when the keyboard was last polled
+static uint32_t poll_pressed_us = 0;                 // when the keys of this poll were pressed
+static volatile bool poll_busy = false;              // a poll is reading the southbridge
+static uint8_t poll_remaining = 0;                   // key events left to read in this poll
+static uint8_t poll_events = 0;                      // key events found by the last poll
+
+// Latency statistics
+static uint32_t latency_keys = 0;     // keys read
+static uint64_t latency_total_us = 0; // sum of the latencies
+static uint32_t latency_max_us = 0;   // longest latency
+
 //
 //  Keyboard Driver
 //
 //  This section implements the keyboard driver, which polls the
 //  keyboard for key events and buffers them for processing. It uses
-//  a repeating timer to poll the keyboard at regular intervals.
+//  a repeating timer to poll the keyboard, every KEYBOARD_POLL_FAST_MS
+//  while keys are being pressed, backing off to KEYBOARD_POLL_MS when idle.
+//  Each poll drains all the events waiting in the southbridge FIFO.
+//
+//  A key was pressed some time between the poll before and the poll
+//  that found it, so the middle of the two is taken as when it was
+//  pressed. The latency is from then until the key is read.
 //
 
-void keyboard_poll()
+// Add an event to the queue, dropping it if the queue is full
+static void keyboard_queue_event(uint8_t code, uint8_t state)
+{
+    uint32_t head = event_head;
+    uint32_t depth = head - event_tail;
+
+    if (depth >= KBD_EVENT_QUEUE_SIZE)
+    {
+        events_dropped++; // never overwrite an event that has not been read
+        return;
+    }
+
+    keyboard_event_t *event = &event_queue[head % KBD_EVENT_QUEUE_SIZE];
+    event->code = code;
+    event->state = state;
+    event->modifiers = (key_control ? KEY_MODIFIER_CTRL : 0) |
+                       (key_shift ? KEY_MODIFIER_SHIFT : 0) |
+                       (key_alt ? KEY_MODIFIER_ALT : 0);
+    event->timestamp_us = poll_pressed_us;
+
+    __dmb(); // write the event before the head that covers it
+    event_head = head + 1;
+
+    events_queued++;
+    events_deepest = MAX(events_deepest, depth + 1);
+
+    // Notify that keys are available
+    if (state == KEY_STATE_PRESSED && keyboard_key_available_callback)
+    {
+        keyboard_key_available_callback();
+    }
+}
+
+static void keyboard_process(uint16_t key)
 {
-    uint16_t key = sb_read_keyboard();
     uint8_t key_state = (key >> 8) & 0xFF;
     uint8_t key_code = key & 0xFF;
 
-    if (key_state != 0)
+    if (key_state == KEY_STATE_IDLE)
+    {
+        return; // the FIFO was empty
+    }
+
+    // Keep track of the modifiers, the event carries the modifiers held with it
+    bool pressed = key_state != KEY_STATE_RELEASED;
+    if (key_code == KEY_MOD_CTRL)
+    {
+        key_control = pressed;
+    }
+    else if (key_code == KEY_MOD_SHL || key_code == KEY_MOD_SHR)
+    {
+        key_shift = pressed;
+    }
+    else if (key_code == KEY_MOD_ALT)
+    {
+        key_alt = pressed;
+    }
+    else if (key_code == KEY_BREAK && key_state == KEY_STATE_PRESSED)
+    {
+        user_interrupt = true; // set user interrupt flag
+    }
+
+    keyboard_queue_event(key_code, key_state);
+}
+
+// Translate a key event to a character, or -1 if it is not one
+static int keyboard_event_char(const keyboard_event_t *event)
+{
+    if (event->state != KEY_STATE_PRESSED)
+    {
+        return -1;
+    }
+
+    uint8_t ch = event->code;
+    switch (ch)
     {
-        if (key_state == KEY_STATE_PRESSED)
+    case KEY_MOD_ALT:
+    case KEY_MOD_SHL:
+    case KEY_MOD_SHR:
+    case KEY_MOD_SYM:
+    case KEY_MOD_CTRL:
+    case KEY_BREAK:
+    case KEY_CAPS_LOCK: // processed in the south bridge
+        return -1;
+    }
+
+    bool control = event->modifiers & KEY_MODIFIER_CTRL;
+    bool shift = event->modifiers & KEY_MODIFIER_SHIFT;
+    if (ch >= 'a' && ch <= 'z') // Ctrl and Shift handling
+    {
+        if (control)
         {
-            if (key_code == KEY_MOD_CTRL)
-            {
-                key_control = true;
-            }
-            else if (key_code == KEY_MOD_SHL || key_code == KEY_MOD_SHR)
-            {
-                key_shift = true;
-            }
-            else if (key_code == KEY_MOD_ALT)
-            {
-                key_alt = true;
-            }
-            else if (key_code == KEY_BREAK)
-            {
-                user_interrupt = true; // set user interrupt flag
-            }
-            else if (key_code == KEY_CAPS_LOCK)
-            {
-                // do nothing, processed in the south bridge
-            }
-            else
-            {
-                // If a key is released, we return the key code
-                // This allows us to handle the key release in the main loop
-                uint8_t ch = key_code;
-                if (ch >= 'a' && ch <= 'z') // Ctrl and Shift handling
-                {
-                    if (key_control)
-                    {
-                        ch &= 0x1F; // convert to control character
-                    }
-                    if (key_shift)
-                    {
-                        ch &= ~0x20;
-                    }
-                }
-                else if (ch == KEY_ENTER) // enter key is returned as LF
-                {
-                    ch = KEY_RETURN; // convert LF to CR
-                }
-
-                uint16_t next_head = (rx_head + 1) & (KBD_BUFFER_SIZE - 1);
-                rx_buffer[rx_head] = ch;
-                rx_head = next_head;
-
-                // Notify that characters are available
-                if (keyboard_key_available_callback)
-                {
-                    keyboard_key_available_callback();
-                }
-            }
+            ch &= 0x1F; // convert to control character
         }
-        else if (key_state == KEY_STATE_RELEASED)
+        if (shift)
         {
-            if (key_code == KEY_MOD_CTRL)
-            {
-                key_control = false;
-            }
-            else if (key_code == KEY_MOD_SHL || key_code == KEY_MOD_SHR)
-            {
-                key_shift = false;
-            }
+            ch &= ~0x20;
         }
     }
+    else if (ch == KEY_ENTER) // enter key is returned as LF
+    {
+        ch = KEY_RETURN; // convert LF to CR
+    }
+    else if (shift && ch == KEY_PAGE_UP)
+    {
+        ch = KEY_SHIFT_PAGE_UP;
+    }
+    else if (shift && ch == KEY_PAGE_DOWN)
+    {
+        ch = KEY_SHIFT_PAGE_DOWN;
+    }
+
+    return ch;
+}
+
+static void on_key_event(bool ok, const uint8_t *response, void *param);
+
+// Read the next key event waiting in the southbridge FIFO, or finish the poll
+static void keyboard_read_next()
+{
+    uint8_t command = SB_REG_FIF;
+
+    if (poll_remaining > 0 && sb_submit(SB_PRIORITY_KEYBOARD, &command, 1, 2, on_key_event, NULL))
+    {
+        return;
+    }
+    poll_busy = false;
+}
+
+static void on_key_event(bool ok, const uint8_t *response, void *param)
+{
+    if (ok)
+    {
+        keyboard_process(response[0] << 8 | response[1]);
+        poll_remaining--;
+    }
+    else
+    {
+        poll_remaining = 0; // try again next poll
+    }
+    keyboard_read_next();
+}
+
+static void on_key_status(bool ok, const uint8_t *response, void *param)
+{
+    uint32_t now = time_us_32();
+
+    poll_pressed_us = poll_last_us + (now - poll_last_us) / 2;
+    poll_last_us = now;
+
+    // Read all the key events waiting in the FIFO
+    poll_remaining = ok ? response[1] & SB_KEY_COUNT_MASK : 0;
+    poll_events = poll_remaining;
+    keyboard_read_next();
+}
+
+// Start reading the key events from the southbridge, they are buffered as they arrive
+void keyboard_poll()
+{
+    uint8_t command = SB_REG_KEY;
+
+    if (poll_busy)
+    {
+        return; // the last poll is still reading
+    }
+
+    poll_busy = true;
+    if (!sb_submit(SB_PRIORITY_KEYBOARD, &command, 1, 2, on_key_status, NULL))
+    {
+        poll_busy = false;
+    }
 }
 
 static bool on_keyboard_timer(repeating_timer_t *rt)
 {
-    if (!sb_available())
+    if (poll_busy)
     {
-        return true; // if southbridge is not available, skip this timer tick
+        return true; // the last poll is still reading, skip this timer tick
     }
 
+    if (poll_events > 0)
+    {
+        poll_interval_ms = KEYBOARD_POLL_FAST_MS; // more keys are likely to follow
+    }
+    else
+    {
+        poll_interval_ms = MIN(poll_interval_ms * 2, KEYBOARD_POLL_MS); // back off while idle
+    }
+    rt->delay_us = -(int64_t)poll_interval_ms * 1000;
+
+    poll_events = 0;
     keyboard_poll();
 
     return true; // continue the timer
@@ -135,9 +269,57 @@ static bool on_keyboard_timer(repeating_timer_t *rt)
 // Keyboard API
 //
 
+bool keyboard_event_available()
+{
+    return event_head != event_tail;
+}
+
+// Take the oldest event from the queue, returning false if there is none
+bool keyboard_get_event(keyboard_event_t *event)
+{
+    uint32_t tail = event_tail;
+
+    if (event_head == tail)
+    {
+        return false;
+    }
+
+    __dmb(); // read the event only after the head that covers it
+    *event = event_queue[tail % KBD_EVENT_QUEUE_SIZE];
+    __dmb(); // finish with the event before giving the slot back
+    event_tail = tail + 1;
+
+    if (event->state == KEY_STATE_PRESSED)
+    {
+        uint32_t latency_us = time_us_32() - event->timestamp_us;
+        latency_keys++;
+        latency_total_us += latency_us;
+        latency_max_us = MAX(latency_max_us, latency_us);
+    }
+
+    return true;
+}
+
+//
+// Character adapter
+//
+// The events that are not characters are dropped from the queue.
+//
+
 bool keyboard_key_available()
 {
-    return rx_head != rx_tail;
+    while (keyboard_event_available())
+    {
+        __dmb(); // read the event only after the head that covers it
+        if (keyboard_event_char(&event_queue[event_tail % KBD_EVENT_QUEUE_SIZE]) >= 0)
+        {
+            return true;
+        }
+
+        keyboard_event_t event;
+        keyboard_get_event(&event);
+    }
+    return false;
 }
 
 char keyboard_get_key()
@@ -147,9 +329,44 @@ char keyboard_get_key()
         tight_loop_contents();
     }
 
-    char ch = rx_buffer[rx_tail];
-    rx_tail = (rx_tail + 1) & (KBD_BUFFER_SIZE - 1);
-    return ch;
+    keyboard_event_t event;
+    keyboard_get_event(&event);
+    return keyboard_event_char(&event);
+}
+
+// Get the number of events queued, the number dropped because the queue was full and the
+// most that were waiting at once
+void keyboard_get_event_stats(uint32_t *queued, uint32_t *dropped, uint32_t *deepest)
+{
+    if (queued)
+    {
+        *queued = events_queued;
+    }
+    if (dropped)
+    {
+        *dropped = events_dropped;
+    }
+    if (deepest)
+    {
+        *deepest = events_deepest;
+    }
+}
+
+// Get the number of keys read, and their average and longest latency from being pressed
+void keyboard_get_latency_stats(uint32_t *keys, uint32_t *average_us, uint32_t *max_us)
+{
+    if (keys)
+    {
+        *keys = latency_keys;
+    }
+    if (average_us)
+    {
+        *average_us = latency_keys ? latency_total_us / latency_keys : 0;
+    }
+    if (max_us)
+    {
+        *max_us = latency_max_us;
+    }
 }
 
 
@@ -167,8 +384,10 @@ void keyboard_set_background_poll(bool enable)
 {
     if (enable)
     {
-        // Start the repeating timer to poll the keyboard
-        // poll every 100 ms for key events
+        // Start the repeating timer to poll the keyboard, the
+        // interval adapts to how often keys are pressed
+        poll_interval_ms = KEYBOARD_POLL_MS;
+        poll_last_us = time_us_32();
         add_repeating_timer_ms(-KEYBOARD_POLL_MS, on_keyboard_timer, NULL, &key_timer);
     }
     else
@@ -14,6 +14,10 @@
 #define KEY_STATE_HOLD      (2)
 #define KEY_STATE_RELEASED  (3)
 
+#define KEY_MODIFIER_CTRL   (0x01)          // control held
+#define KEY_MODIFIER_SHIFT  (0x02)          // either shift held
+#define KEY_MODIFIER_ALT    (0x04)          // alt held
+
 #define KEY_BACKSPACE       (0x08)
 #define KEY_TAB             (0x09)
 #define KEY_ENTER           (0x0A)
@@ -33,6 +37,8 @@
 #define KEY_END             (0xD5)
 #define KEY_PAGE_UP         (0xD6)
 #define KEY_PAGE_DOWN       (0xD7)
+#define KEY_SHIFT_PAGE_UP   (0xE6)          // page up with shift (scrollback review)
+#define KEY_SHIFT_PAGE_DOWN (0xE7)          // page down with shift (scrollback review)
 
 #define KEY_CAPS_LOCK       (0xC1)
 
@@ -50,9 +56,19 @@
 #define KEY_POWER           (0x91)
 
 // Keyboard defaults
-#define KBD_BUFFER_SIZE     (32)
-#define KEYBOARD_POLL_MS    (100) // poll keyboard every 100 ms
+#define KBD_EVENT_QUEUE_SIZE  (64)  // key events that can wait to be read (a power of two)
+#define KEYBOARD_POLL_MS      (100) // poll keyboard every 100 ms when idle
+#define KEYBOARD_POLL_FAST_MS (20)  // poll keyboard every 20 ms after a key event
+
 
+// A key event read from the southbridge
+typedef struct
+{
+    uint8_t code;          // key code
+    uint8_t modifiers;     // KEY_MODIFIER_* bits held with the key
+    uint8_t state;         // KEY_STATE_PRESSED, KEY_STATE_HOLD or KEY_STATE_RELEASED
+    uint32_t timestamp_us; // when the key was pressed (estimated, time_us_32)
+} keyboard_event_t;
 
 // Callback function type for when a key becomes available
 typedef void (*keyboard_key_available_callback_t)(void);
@@ -62,5 +78,9 @@ void keyboard_init(void);
 void keyboard_set_key_available_callback(keyboard_key_available_callback_t callback);
 void keyboard_set_background_poll(bool enable);
 void keyboard_poll(void);
+bool keyboard_event_available(void);
+bool keyboard_get_event(keyboard_event_t *event);
+void keyboard_get_event_stats(uint32_t *queued, uint32_t *dropped, uint32_t *deepest);
 bool keyboard_key_available(void);
 char keyboard_get_key(void);
+void keyboard_get_latency_stats(uint32_t *keys, uint32_t *average_us, uint32_t *max_us);
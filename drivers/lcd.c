@@ -7,6 +7,9 @@
 //  and 65K colours in the RGB565 format. This driver requires little memory as it
 //  uses the frame memory on the controller directly.
 //
+//  Pixel data is sent to the controller by DMA from a queue of blits, so drawing
+//  overlaps with the caller's work and interrupts stay enabled while it happens.
+//
 //  NOTE: Some code below is written to respect timing constraints of the ST7789P controller.
 //        For instance, you can usually get away with a short chip select high pulse widths, but
 //        writing to the display RAM requires the minimum chip select high pulse width of 40ns.
@@ -17,6 +20,8 @@
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
 
 #include "lcd.h"
 
@@ -35,17 +40,52 @@ static bool reverse = false;    // reverse video state
 static bool bold = false;       // bold text state
 
 // Text drawing
+// The line buffer is in flight until its blit completes, so it remembers
+// the ticket of the blit that last used it
 const font_t *font = &font_8x10; // default font is 8x10
-static uint16_t char_buffer[8 * GLYPH_HEIGHT] __attribute__((aligned(4)));
 static uint16_t line_buffer[WIDTH * GLYPH_HEIGHT] __attribute__((aligned(4)));
+static uint32_t line_buffer_ticket = 0;
+
+// Glyph rendering
+static uint16_t nibble_pixels[16][4] __attribute__((aligned(8))); // pixels for each nibble of glyph bits
+static bool nibble_pixels_valid = false;                           // pixels match the current colours
+static void lcd_render_glyph_8x10(uint16_t *buffer, const uint8_t *glyph);
+static void lcd_render_glyph_5x10(uint16_t *buffer, const uint8_t *glyph);
+static void (*lcd_render_glyph_kernel)(uint16_t *buffer, const uint8_t *glyph) = lcd_render_glyph_8x10;
+
+// Blit queue
+typedef struct
+{
+    const uint16_t *pixels; // pixel data, or NULL to fill with colour
+    uint16_t colour;        // fill colour
+    uint16_t x0, y0;        // top left of the window in display RAM
+    uint16_t x1, y1;        // bottom right of the window in display RAM
+    uint32_t count;         // number of pixels to send
+} lcd_blit_job_t;
+
+static lcd_blit_job_t blit_queue[LCD_BLIT_QUEUE_DEPTH];
+static volatile uint32_t blit_queued = 0;    // ticket of the last blit queued
+static volatile uint32_t blit_completed = 0; // ticket of the last blit completed
+static volatile bool blit_active = false;    // a blit is being sent by DMA
+static int blit_dma_channel = -1;
 
 // Background processing
 static uint32_t irq_state;
 static repeating_timer_t cursor_timer;
 
+static void lcd_blit_service(void);
+
+// Commands cannot be sent while a blit holds the bus, so wait for the blit
+// queue to drain before disabling interrupts
 static void lcd_disable_interrupts()
 {
     irq_state = save_and_disable_interrupts();
+    while (blit_queued != blit_completed)
+    {
+        restore_interrupts(irq_state);
+        lcd_blit_service();
+        irq_state = save_and_disable_interrupts();
+    }
     //gpio_put(3, true);
 }
 
@@ -67,6 +107,7 @@ void lcd_set_reverse(bool reverse_on)
         uint16_t temp = foreground;
         foreground = background;
         background = temp;
+        nibble_pixels_valid = false;
     }
     reverse = reverse_on;
 }
@@ -79,14 +120,15 @@ void lcd_set_underscore(bool underscore_on)
 
 void lcd_set_bold(bool bold_on)
 {
-    // Toggles the bold state. Bold text is implemented in the lcd_putc function.
+    // Toggles the bold state. Bold text is implemented in the glyph rendering kernels.
     bold = bold_on;
 }
 
 void lcd_set_font(const font_t *new_font)
 {
-    // Set the new font
+    // Set the new font and its rendering kernel
     font = new_font;
+    lcd_render_glyph_kernel = font->width == 8 ? lcd_render_glyph_8x10 : lcd_render_glyph_5x10;
 }
 
 uint8_t lcd_get_columns(void)
@@ -104,26 +146,24 @@ uint8_t lcd_get_glyph_width(void)
 // Set foreground colour
 void lcd_set_foreground(uint16_t colour)
 {
-    if (reverse)
+    // if reverse is enabled, set background to the new foreground colour
+    uint16_t *target = reverse ? &background : &foreground;
+    if (*target != colour)
     {
-        background = colour; // if reverse is enabled, set background to the new foreground colour
-    }
-    else
-    {
-        foreground = colour;
+        *target = colour;
+        nibble_pixels_valid = false;
     }
 }
 
 // Set background colour
 void lcd_set_background(uint16_t colour)
 {
-    if (reverse)
+    // if reverse is enabled, set foreground to the new background colour
+    uint16_t *target = reverse ? &foreground : &background;
+    if (*target != colour)
     {
-        foreground = colour; // if reverse is enabled, set foreground to the new background colour
-    }
-    else
-    {
-        background = colour;
+        *target = colour;
+        nibble_pixels_valid = false;
     }
 }
 
@@ -218,6 +258,127 @@ static void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1)
     lcd_write_cmd(LCD_CMD_RAMWR);
 }
 
+//
+//  Blit queue
+//
+//  Blits are queued and sent to the display by DMA, one after another. The DMA completion
+//  interrupt finishes a blit and starts the next one. Each blit is given a ticket, in
+//  increasing order, that can be waited on. Anything that waits also services the queue
+//  itself, so waiting works with interrupts disabled (in the cursor timer, for instance).
+//
+
+// Start sending the blit at the head of the queue (interrupts must be disabled)
+static void lcd_blit_start(void)
+{
+    lcd_blit_job_t *job = &blit_queue[blit_completed % LCD_BLIT_QUEUE_DEPTH];
+
+    lcd_set_window(job->x0, job->y0, job->x1, job->y1);
+
+    // DO NOT MOVE THE spi_set_format() OR THE gpio_put(LCD_DCX) CALLS!
+    // They are placed before the gpio_put(LCD_CSX) to ensure that a minimum
+    // chip select high pulse width is achieved (at least 40ns)
+    spi_set_format(LCD_SPI, 16, 0, 0, SPI_MSB_FIRST);
+    gpio_put(LCD_DCX, 1); // Data
+    gpio_put(LCD_CSX, 0);
+
+    // A fill reads the same colour over and over
+    dma_channel_config config = dma_channel_get_default_config(blit_dma_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+    channel_config_set_read_increment(&config, job->pixels != NULL);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, spi_get_dreq(LCD_SPI, true));
+    dma_channel_configure(blit_dma_channel, &config,
+                          &spi_get_hw(LCD_SPI)->dr,
+                          job->pixels ? job->pixels : &job->colour,
+                          job->count,
+                          true);
+
+    blit_active = true;
+}
+
+// Complete the blit being sent, if the DMA has finished, and start the next
+static void lcd_blit_service(void)
+{
+    uint32_t state = save_and_disable_interrupts();
+
+    if (blit_active && !dma_channel_is_busy(blit_dma_channel))
+    {
+        // The last pixels are still leaving the SPI FIFO
+        while (spi_is_busy(LCD_SPI))
+        {
+            tight_loop_contents();
+        }
+        while (spi_is_readable(LCD_SPI))
+        {
+            (void)spi_get_hw(LCD_SPI)->dr;
+        }
+        spi_get_hw(LCD_SPI)->icr = SPI_SSPICR_RORIC_BITS;
+
+        gpio_put(LCD_CSX, 1);
+        spi_set_format(LCD_SPI, 8, 0, 0, SPI_MSB_FIRST);
+        dma_channel_acknowledge_irq1(blit_dma_channel);
+
+        blit_active = false;
+        blit_completed++;
+    }
+
+    if (!blit_active && blit_completed != blit_queued)
+    {
+        lcd_blit_start();
+    }
+
+    restore_interrupts(state);
+}
+
+static void lcd_blit_irq_handler(void)
+{
+    if (dma_channel_get_irq1_status(blit_dma_channel))
+    {
+        dma_channel_acknowledge_irq1(blit_dma_channel);
+        lcd_blit_service();
+    }
+}
+
+// Add a blit to the queue, waiting for room if it is full
+static uint32_t lcd_blit_queue(const lcd_blit_job_t *job)
+{
+    uint32_t state = save_and_disable_interrupts();
+    while (blit_queued - blit_completed >= LCD_BLIT_QUEUE_DEPTH)
+    {
+        restore_interrupts(state);
+        lcd_blit_service();
+        state = save_and_disable_interrupts();
+    }
+
+    blit_queue[blit_queued % LCD_BLIT_QUEUE_DEPTH] = *job;
+    uint32_t ticket = ++blit_queued;
+    restore_interrupts(state);
+
+    lcd_blit_service(); // start it if the queue was idle
+    return ticket;
+}
+
+// Check if a blit has been sent to the display
+bool lcd_blit_done(uint32_t ticket)
+{
+    return (int32_t)(blit_completed - ticket) >= 0;
+}
+
+// Wait for a blit to be sent to the display
+void lcd_blit_wait(uint32_t ticket)
+{
+    while (!lcd_blit_done(ticket))
+    {
+        lcd_blit_service();
+    }
+}
+
+// Wait for all queued blits to be sent to the display
+void lcd_blit_fence(void)
+{
+    lcd_blit_wait(blit_queued);
+}
+
 //
 //  Send pixel data to the display
 //
@@ -229,44 +390,71 @@ static void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1)
 //  The pixel data is expected to be in RGB565 format, which is a 16-bit value with the
 //  red component in the upper 5 bits, the green component in the middle 6 bits, and the
 //  blue component in the lower 5 bits.
+//
+//  The pixels are sent after this function returns, so they must not be changed until the
+//  returned ticket is done.
 
-void lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+// Queue the blits for a region, split where it leaves the scrolling area or wraps around
+// the end of the scrolling area in display RAM. Without pixels, the region is filled with
+// the colour.
+static uint32_t lcd_blit_region(const uint16_t *pixels, uint16_t colour, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
 {
-    lcd_disable_interrupts();
-    if (y >= lcd_scroll_top && y < HEIGHT - lcd_scroll_bottom)
+    uint32_t ticket = blit_queued;
+
+    if (width == 0)
     {
-        // Adjust y for vertical scroll offset and wrap within memory height
-        uint16_t y_virtual = (lcd_y_offset + y) % lcd_memory_scroll_height;
-        uint16_t y_end = lcd_scroll_top + y_virtual + height - 1;
-        if (y_end >= lcd_scroll_top + lcd_memory_scroll_height)
-        {
-            y_end = lcd_scroll_top + lcd_memory_scroll_height - 1;
-        }
-        lcd_set_window(x, lcd_scroll_top + y_virtual, x + width - 1, y_end);
+        return ticket;
     }
-    else
+
+    while (height > 0)
     {
-        // No vertical scrolling, use the actual y-coordinate
-        lcd_set_window(x, y, x + width - 1, y + height - 1);
+        lcd_blit_job_t job = {.pixels = pixels, .colour = colour, .x0 = x, .x1 = x + width - 1};
+        uint16_t rows = height;
+
+        if (y >= lcd_scroll_top && y < HEIGHT - lcd_scroll_bottom)
+        {
+            // Adjust y for vertical scroll offset and wrap within memory height
+            uint16_t y_virtual = (lcd_y_offset + y - lcd_scroll_top) % lcd_memory_scroll_height;
+            rows = MIN(rows, HEIGHT - lcd_scroll_bottom - y);
+            rows = MIN(rows, lcd_memory_scroll_height - y_virtual);
+            job.y0 = lcd_scroll_top + y_virtual;
+        }
+        else
+        {
+            // No vertical scrolling, use the actual y-coordinate
+            if (y < lcd_scroll_top)
+            {
+                rows = MIN(rows, lcd_scroll_top - y);
+            }
+            job.y0 = y;
+        }
+        job.y1 = job.y0 + rows - 1;
+        job.count = width * rows;
+
+        ticket = lcd_blit_queue(&job);
+
+        if (pixels)
+        {
+            pixels += width * rows;
+        }
+        y += rows;
+        height -= rows;
     }
 
-    lcd_write16_buf((uint16_t *)pixels, width * height);
-    lcd_enable_interrupts();
+    return ticket;
+}
+
+uint32_t lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+    return lcd_blit_region(pixels, 0, x, y, width, height);
 }
 
 // Draw a solid rectangle on the display
 void lcd_solid_rectangle(uint16_t colour, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
 {
-    static uint16_t pixels[WIDTH];
-
-    for (uint16_t row = 0; row < height; row++)
-    {
-        for (uint16_t i = 0; i < width; i++)
-        {
-            pixels[i] = colour;
-        }
-        lcd_blit(pixels, x, y + row, width, 1);
-    }
+    // The window is set once and the DMA reads the colour, which travels with the blit,
+    // over and over, so there is no pixel buffer to fill or wait on
+    lcd_blit_region(NULL, colour, x, y, width, height);
 }
 
 //
@@ -283,18 +471,28 @@ void lcd_solid_rectangle(uint16_t colour, uint16_t x, uint16_t y, uint16_t width
 void lcd_define_scrolling(uint16_t top_fixed_area, uint16_t bottom_fixed_area)
 {
     uint16_t scroll_area = HEIGHT - (top_fixed_area + bottom_fixed_area);
-    if (scroll_area == 0 || scroll_area > FRAME_HEIGHT)
+    if (top_fixed_area + bottom_fixed_area >= HEIGHT)
     {
         // Invalid scrolling area, reset to full screen
         top_fixed_area = 0;
         bottom_fixed_area = 0;
+    }
+
+    // The fixed areas and the scroll area together cover the display RAM, and the rows
+    // of display RAM below the panel belong to the bottom fixed area. Without fixed areas,
+    // the scroll area is all of the display RAM, otherwise it is the rows between the
+    // fixed areas on the panel.
+    if (top_fixed_area == 0 && bottom_fixed_area == 0)
+    {
         scroll_area = FRAME_HEIGHT;
     }
-    
+
     lcd_scroll_top = top_fixed_area;
-    lcd_memory_scroll_height = FRAME_HEIGHT - (top_fixed_area + bottom_fixed_area);
+    lcd_memory_scroll_height = scroll_area;
     lcd_scroll_bottom = bottom_fixed_area;
 
+    uint16_t memory_bottom = FRAME_HEIGHT - (lcd_scroll_top + scroll_area);
+
     lcd_disable_interrupts();
     lcd_write_cmd(LCD_CMD_VSCRDEF);
     lcd_write_data(6,
@@ -302,8 +500,8 @@ void lcd_define_scrolling(uint16_t top_fixed_area, uint16_t bottom_fixed_area)
                    LOWER8(lcd_scroll_top),
                    UPPER8(scroll_area),
                    LOWER8(scroll_area),
-                   UPPER8(lcd_scroll_bottom),
-                   LOWER8(lcd_scroll_bottom));
+                   UPPER8(memory_bottom),
+                   LOWER8(memory_bottom));
     lcd_enable_interrupts();
 
     lcd_scroll_reset(); // Reset the scroll area to the top
@@ -345,8 +543,8 @@ void lcd_scroll_up()
     lcd_write_data(2, UPPER8(scroll_area_start), LOWER8(scroll_area_start));
     lcd_enable_interrupts();
 
-    // Clear the new line at the bottom
-    lcd_solid_rectangle(background, 0, HEIGHT - GLYPH_HEIGHT, WIDTH, GLYPH_HEIGHT);
+    // Clear the new line at the bottom of the scroll area
+    lcd_solid_rectangle(background, 0, HEIGHT - lcd_scroll_bottom - GLYPH_HEIGHT, WIDTH, GLYPH_HEIGHT);
 }
 
 // Scroll the screen down one line (making space at the top)
@@ -385,142 +583,291 @@ void lcd_erase_line(uint8_t row, uint8_t col_start, uint8_t col_end)
     lcd_solid_rectangle(background, col_start * font->width, row * GLYPH_HEIGHT, (col_end - col_start + 1) * font->width, GLYPH_HEIGHT);
 }
 
-// Draw a character at the specified position
-void lcd_putc(uint8_t column, uint8_t row, uint8_t c)
+//
+// Glyph rendering kernels
+//
+// Each row of a glyph is rendered four pixels at a time from a table that maps a nibble of
+// glyph bits to its pixels in the current colours. The table is rebuilt only when the
+// colours have changed. Bold and underscore are applied to the glyph bits before the
+// lookup. There is a kernel for each font width, selected when the font is set.
+//
+
+static void lcd_build_nibble_pixels()
 {
-    const uint8_t *glyph = &font->glyphs[c * GLYPH_HEIGHT];
-    uint16_t *buffer = char_buffer;
+    for (uint8_t n = 0; n < 16; n++)
+    {
+        nibble_pixels[n][0] = (n & 0x08) ? foreground : background;
+        nibble_pixels[n][1] = (n & 0x04) ? foreground : background;
+        nibble_pixels[n][2] = (n & 0x02) ? foreground : background;
+        nibble_pixels[n][3] = (n & 0x01) ? foreground : background;
+    }
+    nibble_pixels_valid = true;
+}
 
-    if (font->width == 8)
+static void lcd_render_glyph_8x10(uint16_t *buffer, const uint8_t *glyph)
+{
+    uint32_t *pixels = (uint32_t *)buffer;
+
+    for (uint8_t i = 0; i < GLYPH_HEIGHT; i++)
     {
-        for (uint8_t i = 0; i < GLYPH_HEIGHT; i++, glyph++)
+        uint8_t bits = glyph[i];
+        if (i == GLYPH_HEIGHT - 1)
         {
-            if (i < GLYPH_HEIGHT - 1)
-            {
-                // Fill the row with the glyph data
-                *(buffer++) = (*glyph & 0x80) ? foreground : background;
-                *(buffer++) = (*glyph & 0x40) || (bold && (*glyph & 0x80)) ? foreground : background;
-                *(buffer++) = (*glyph & 0x20) || (bold && (*glyph & 0x40)) ? foreground : background;
-                *(buffer++) = (*glyph & 0x10) || (bold && (*glyph & 0x20)) ? foreground : background;
-                *(buffer++) = (*glyph & 0x08) || (bold && (*glyph & 0x10)) ? foreground : background;
-                *(buffer++) = (*glyph & 0x04) || (bold && (*glyph & 0x08)) ? foreground : background;
-                *(buffer++) = (*glyph & 0x02) || (bold && (*glyph & 0x04)) ? foreground : background;
-                *(buffer++) = (*glyph & 0x01) || (bold && (*glyph & 0x02)) ? foreground : background;
-            }
-            else
-            {
-                // The last row is where the underscore is drawn, but if no underscore is set, fill with glyph data
-                *(buffer++) = (*glyph & 0x80) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x40) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x20) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x10) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x08) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x04) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x02) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x01) || underscore ? foreground : background;
-            }
+            // The last row is where the underscore is drawn
+            bits = underscore ? 0xFF : bits;
+        }
+        else if (bold)
+        {
+            bits |= bits >> 1;
         }
+
+        const uint32_t *high = (const uint32_t *)nibble_pixels[bits >> 4];
+        const uint32_t *low = (const uint32_t *)nibble_pixels[bits & 0x0F];
+        *(pixels++) = high[0];
+        *(pixels++) = high[1];
+        *(pixels++) = low[0];
+        *(pixels++) = low[1];
     }
-    else
+}
+
+static void lcd_render_glyph_5x10(uint16_t *buffer, const uint8_t *glyph)
+{
+    for (uint8_t i = 0; i < GLYPH_HEIGHT; i++)
     {
-        for (uint8_t i = 0; i < GLYPH_HEIGHT; i++, glyph++)
+        uint8_t bits = glyph[i];
+        if (i == GLYPH_HEIGHT - 1)
         {
-            if (i < GLYPH_HEIGHT - 1)
-            {
-                // Fill the row with the glyph data
-                *(buffer++) = (*glyph & 0x10) ? foreground : background;
-                *(buffer++) = (*glyph & 0x08) ? foreground : background;
-                *(buffer++) = (*glyph & 0x04) ? foreground : background;
-                *(buffer++) = (*glyph & 0x02) ? foreground : background;
-                *(buffer++) = (*glyph & 0x01) ? foreground : background;
-            }
-            else
-            {
-                // The last row is where the underscore is drawn, but if no underscore is set, fill with glyph data
-                *(buffer++) = (*glyph & 0x10) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x08) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x04) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x02) || underscore ? foreground : background;
-                *(buffer++) = (*glyph & 0x01) || underscore ? foreground : background;
-            }
+            // The last row is where the underscore is drawn
+            bits = underscore ? 0x1F : bits;
         }
+
+        const uint16_t *low = nibble_pixels[bits & 0x0F];
+        *(buffer++) = (bits & 0x10) ? foreground : background;
+        *(buffer++) = low[0];
+        *(buffer++) = low[1];
+        *(buffer++) = low[2];
+        *(buffer++) = low[3];
     }
+}
 
-    lcd_blit(char_buffer, column * font->width, row * GLYPH_HEIGHT, font->width, GLYPH_HEIGHT);
+// Render a glyph in the current font, colours and attributes
+static void lcd_render_glyph(uint16_t *buffer, uint8_t c)
+{
+    if (!nibble_pixels_valid)
+    {
+        lcd_build_nibble_pixels();
+    }
+    lcd_render_glyph_kernel(buffer, &font->glyphs[c * GLYPH_HEIGHT]);
 }
 
-// Draw a string at the specified position
-void lcd_putstr(uint8_t column, uint8_t row, const char *str)
+//
+// Glyph cache
+//
+// Rendered glyphs are kept in a cache keyed by the font, the character, the colours and
+// the attributes, so that text drawn again (prompts, listings, box drawing) is copied or
+// sent straight from the cache instead of being expanded bit by bit. When the cache is
+// full, the least recently used glyph is replaced. A glyph can still be in flight when it
+// is replaced, so each one remembers the ticket of the last blit sent from it.
+//
+
+#define GLYPH_CACHE_NONE    (0xFFFF)    // end of a list
+#define GLYPH_CACHE_BUCKETS (64)        // number of hash buckets (power of 2)
+
+typedef struct
+{
+    const font_t *font;  // font the glyph was rendered in
+    uint16_t foreground; // foreground colour
+    uint16_t background; // background colour
+    uint8_t c;           // character (font offset)
+    bool bold;           // rendered bold
+    bool underscore;     // rendered underscored
+    uint16_t next;       // next glyph in the hash bucket
+    uint16_t older;      // next older glyph in use order
+    uint16_t newer;      // next newer glyph in use order
+    uint32_t ticket;     // ticket of the last blit from the pixels
+    uint16_t pixels[8 * GLYPH_HEIGHT] __attribute__((aligned(4)));
+} glyph_cache_entry_t;
+
+#define GLYPH_CACHE_ENTRIES (LCD_GLYPH_CACHE_SIZE / sizeof(glyph_cache_entry_t))
+
+static glyph_cache_entry_t glyph_cache[GLYPH_CACHE_ENTRIES];
+static uint16_t glyph_cache_buckets[GLYPH_CACHE_BUCKETS];
+static uint16_t glyph_cache_used = 0;                  // number of glyphs in the cache
+static uint16_t glyph_cache_newest = GLYPH_CACHE_NONE; // most recently used glyph
+static uint16_t glyph_cache_oldest = GLYPH_CACHE_NONE; // least recently used glyph
+static uint32_t glyph_cache_hits = 0;
+static uint32_t glyph_cache_misses = 0;
+
+static inline uint16_t glyph_cache_hash(const font_t *f, uint8_t c, uint16_t fg, uint16_t bg, bool b, bool u)
 {
-    int len = strlen(str);
-    int pos = 0;
-    while (*str)
+    uint32_t hash = c ^ (fg * 31) ^ (bg * 17) ^ (b << 8) ^ (u << 9) ^ (f->width << 10);
+    return (hash ^ (hash >> 11)) & (GLYPH_CACHE_BUCKETS - 1);
+}
+
+// Take a glyph out of the use order
+static void glyph_cache_unlink(uint16_t index)
+{
+    glyph_cache_entry_t *entry = &glyph_cache[index];
+
+    if (entry->newer != GLYPH_CACHE_NONE)
+    {
+        glyph_cache[entry->newer].older = entry->older;
+    }
+    else
     {
-        uint16_t *buffer = line_buffer + (pos++ * font->width);
-        const uint8_t *glyph = &font->glyphs[*str++ * GLYPH_HEIGHT];
+        glyph_cache_newest = entry->older;
+    }
 
-        if (font->width == 8)
+    if (entry->older != GLYPH_CACHE_NONE)
+    {
+        glyph_cache[entry->older].newer = entry->newer;
+    }
+    else
+    {
+        glyph_cache_oldest = entry->newer;
+    }
+}
+
+// Put a glyph at the most recently used end of the use order
+static void glyph_cache_make_newest(uint16_t index)
+{
+    glyph_cache_entry_t *entry = &glyph_cache[index];
+
+    entry->older = glyph_cache_newest;
+    entry->newer = GLYPH_CACHE_NONE;
+    if (glyph_cache_newest != GLYPH_CACHE_NONE)
+    {
+        glyph_cache[glyph_cache_newest].newer = index;
+    }
+    else
+    {
+        glyph_cache_oldest = index;
+    }
+    glyph_cache_newest = index;
+}
+
+// Find a glyph in the cache, rendering it if it is not there
+static glyph_cache_entry_t *lcd_get_glyph(uint8_t c)
+{
+    uint16_t *bucket = &glyph_cache_buckets[glyph_cache_hash(font, c, foreground, background, bold, underscore)];
+
+    for (uint16_t index = *bucket; index != GLYPH_CACHE_NONE; index = glyph_cache[index].next)
+    {
+        glyph_cache_entry_t *entry = &glyph_cache[index];
+        if (entry->c == c &&
+            entry->foreground == foreground &&
+            entry->background == background &&
+            entry->font == font &&
+            entry->bold == bold &&
+            entry->underscore == underscore)
         {
-            for (uint8_t i = 0; i < GLYPH_HEIGHT; i++, glyph++)
+            glyph_cache_hits++;
+            if (index != glyph_cache_newest)
             {
-                if (i < GLYPH_HEIGHT - 1)
-                {
-                    // Fill the row with the glyph data
-                    *(buffer++) = (*glyph & 0x80) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x40) || (bold && (*glyph & 0x80)) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x20) || (bold && (*glyph & 0x40)) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x10) || (bold && (*glyph & 0x20)) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x08) || (bold && (*glyph & 0x10)) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x04) || (bold && (*glyph & 0x08)) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x02) || (bold && (*glyph & 0x04)) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x01) || (bold && (*glyph & 0x02)) ? foreground : background;
-                }
-                else
-                {
-                    // The last row is where the underscore is drawn, but if no underscore is set, fill with glyph data
-                    *(buffer++) = (*glyph & 0x80) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x40) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x20) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x10) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x08) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x04) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x02) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x01) || underscore ? foreground : background;
-                }
-                buffer += (len - 1) * font->width;
+                glyph_cache_unlink(index);
+                glyph_cache_make_newest(index);
             }
+            return entry;
         }
-        else
+    }
+
+    glyph_cache_misses++;
+
+    // Use a free glyph, or replace the least recently used
+    uint16_t index;
+    if (glyph_cache_used < GLYPH_CACHE_ENTRIES)
+    {
+        index = glyph_cache_used++;
+    }
+    else
+    {
+        index = glyph_cache_oldest;
+        glyph_cache_entry_t *victim = &glyph_cache[index];
+
+        uint16_t *link = &glyph_cache_buckets[glyph_cache_hash(victim->font, victim->c, victim->foreground, victim->background, victim->bold, victim->underscore)];
+        while (*link != index)
         {
-            for (uint8_t i = 0; i < GLYPH_HEIGHT; i++, glyph++)
-            {
-                if (i < GLYPH_HEIGHT - 1)
-                {
-                    // Fill the row with the glyph data
-                    *(buffer++) = (*glyph & 0x10) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x08) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x04) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x02) ? foreground : background;
-                    *(buffer++) = (*glyph & 0x01) ? foreground : background;
-                }
-                else
-                {
-                    // The last row is where the underscore is drawn, but if no underscore is set, fill with glyph data
-                    *(buffer++) = (*glyph & 0x10) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x08) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x04) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x02) || underscore ? foreground : background;
-                    *(buffer++) = (*glyph & 0x01) || underscore ? foreground : background;
-                }
-                buffer += (len - 1) * font->width;
-            }
+            link = &glyph_cache[*link].next;
         }
+        *link = victim->next;
+
+        glyph_cache_unlink(index);
+        lcd_blit_wait(victim->ticket);
+    }
+
+    glyph_cache_entry_t *entry = &glyph_cache[index];
+    entry->font = font;
+    entry->foreground = foreground;
+    entry->background = background;
+    entry->c = c;
+    entry->bold = bold;
+    entry->underscore = underscore;
+    entry->ticket = 0;
+    lcd_render_glyph(entry->pixels, c);
+
+    entry->next = *bucket;
+    *bucket = index;
+    glyph_cache_make_newest(index);
+
+    return entry;
+}
+
+// Get the glyph cache statistics
+void lcd_get_glyph_cache_stats(uint32_t *hits, uint32_t *misses)
+{
+    if (hits)
+    {
+        *hits = glyph_cache_hits;
+    }
+    if (misses)
+    {
+        *misses = glyph_cache_misses;
+    }
+}
+
+// Draw a character at the specified position
+void lcd_putc(uint8_t column, uint8_t row, uint8_t c)
+{
+    // The glyph is sent straight from the cache
+    glyph_cache_entry_t *entry = lcd_get_glyph(c);
+    entry->ticket = lcd_blit(entry->pixels, column * font->width, row * GLYPH_HEIGHT, font->width, GLYPH_HEIGHT);
+}
+
+// Draw a run of glyphs at the specified position
+void lcd_putchars(uint8_t column, uint8_t row, const uint8_t *chars, uint8_t len)
+{
+    uint8_t width = font->width;
+    uint16_t stride = width * len;
+
+    if (len == 0)
+    {
+        return;
     }
 
-    if (len)
+    // Wait for the last blit from the line buffer before reusing it
+    lcd_blit_wait(line_buffer_ticket);
+
+    // Copy each glyph's rows from the cache into the line
+    for (uint8_t pos = 0; pos < len; pos++)
     {
-        lcd_blit(line_buffer, column * font->width, row * GLYPH_HEIGHT, font->width * len, GLYPH_HEIGHT);
+        const uint16_t *pixels = lcd_get_glyph(chars[pos])->pixels;
+        uint16_t *buffer = line_buffer + pos * width;
+
+        for (uint8_t i = 0; i < GLYPH_HEIGHT; i++)
+        {
+            memcpy(buffer, pixels, width * sizeof(uint16_t));
+            pixels += width;
+            buffer += stride;
+        }
     }
+
+    line_buffer_ticket = lcd_blit(line_buffer, column * width, row * GLYPH_HEIGHT, stride, GLYPH_HEIGHT);
+}
+
+// Draw a string at the specified position
+void lcd_putstr(uint8_t column, uint8_t row, const char *str)
+{
+    lcd_putchars(column, row, (const uint8_t *)str, strlen(str));
 }
 
 
@@ -536,9 +883,11 @@ void lcd_putstr(uint8_t column, uint8_t row, const char *str)
 // cursor when printing these if you want to see the box drawing glyphs
 // uncorrupted.
 
-static uint8_t cursor_column = 0;  // cursor x position for drawing
-static uint8_t cursor_row = 0;     // cursor y position for drawing
-static bool cursor_enabled = true; // cursor visibility state
+static uint8_t cursor_column = 0;           // cursor x position for drawing
+static uint8_t cursor_row = 0;              // cursor y position for drawing
+static bool cursor_enabled = true;          // cursor visibility state
+static uint16_t cursor_foreground = 0xFFFF; // colours when the cursor was placed, as the
+static uint16_t cursor_background = 0x0000; // pen may be part way through a render
 
 // Enable or disable the cursor
 void lcd_enable_cursor(bool cursor_on)
@@ -568,6 +917,10 @@ void lcd_move_cursor(uint8_t column, uint8_t row)
         cursor_column = max_col;
     if (cursor_row > MAX_ROW)
         cursor_row = MAX_ROW;
+
+    // The cursor blinks in the colours of the text at its position
+    cursor_foreground = foreground;
+    cursor_background = background;
 }
 
 // Draw the cursor at the current position
@@ -575,7 +928,7 @@ void lcd_draw_cursor()
 {
     if (cursor_enabled)
     {
-        lcd_solid_rectangle(foreground, cursor_column * font->width, ((cursor_row + 1) * GLYPH_HEIGHT) - 1, font->width, 1);
+        lcd_solid_rectangle(cursor_foreground, cursor_column * font->width, ((cursor_row + 1) * GLYPH_HEIGHT) - 1, font->width, 1);
     }
 }
 
@@ -584,7 +937,7 @@ void lcd_erase_cursor()
 {
     if (cursor_enabled)
     {
-        lcd_solid_rectangle(background, cursor_column * font->width, ((cursor_row + 1) * GLYPH_HEIGHT) - 1, font->width, 1);
+        lcd_solid_rectangle(cursor_background, cursor_column * font->width, ((cursor_row + 1) * GLYPH_HEIGHT) - 1, font->width, 1);
     }
 }
 
@@ -648,6 +1001,22 @@ bool on_cursor_timer(repeating_timer_t *rt)
     return true;                      // Keep the timer running
 }
 
+// Run the background processing, the blit interrupt and the cursor blink, on the calling
+// core with timers from the alarm pool (the drawing functions must be called from this core)
+void lcd_start_background(alarm_pool_t *pool)
+{
+    irq_set_enabled(DMA_IRQ_1, true);
+    alarm_pool_add_repeating_timer_ms(pool, -500, on_cursor_timer, NULL, &cursor_timer);
+}
+
+// Stop the background processing on the calling core, after the queued blits are sent
+void lcd_stop_background(void)
+{
+    lcd_blit_fence();
+    cancel_repeating_timer(&cursor_timer);
+    irq_set_enabled(DMA_IRQ_1, false);
+}
+
 // Initialize the LCD display
 void lcd_init()
 {
@@ -679,6 +1048,18 @@ void lcd_init()
     gpio_put(LCD_CSX, 1);
     gpio_put(LCD_RST, 1);
 
+    // start with an empty glyph cache
+    for (int i = 0; i < GLYPH_CACHE_BUCKETS; i++)
+    {
+        glyph_cache_buckets[i] = GLYPH_CACHE_NONE;
+    }
+
+    // initialise the DMA channel that sends blits
+    blit_dma_channel = dma_claim_unused_channel(true);
+    dma_channel_set_irq1_enabled(blit_dma_channel, true);
+    irq_add_shared_handler(DMA_IRQ_1, lcd_blit_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
+
     lcd_disable_interrupts();
 
     lcd_reset(); // reset the LCD controller
@@ -701,7 +1082,7 @@ void lcd_init()
     lcd_write_cmd(LCD_CMD_VSCRDEF); // vertical scroll definition
     lcd_write_data(6,
                    0x00, 0x00, // top fixed area of 0 pixels
-                   0x01, 0x40, // scroll area height of 320 pixels
+                   0x01, 0xE0, // scroll area height of 480 pixels (all of display RAM)
                    0x00, 0x00  // bottom fixed area of 0 pixels
     );
 
@@ -718,7 +1099,7 @@ void lcd_init()
     lcd_display_on();
 
     // Blink the cursor every second (500 ms on, 500 ms off)
-    add_repeating_timer_ms(-500, on_cursor_timer, NULL, &cursor_timer);
+    lcd_start_background(alarm_pool_get_default());
 
     lcd_initialised = true; // Set the initialised flag
 }
\ No newline at end of file
@@ -19,6 +19,8 @@
 // However, the controller can handle 75 MHz in practice.
 #define LCD_BAUDRATE    (75000000)      // 75 MHz SPI clock speed
 #define LCD_I2C_TIMEOUT_US (1000)       // I2C timeout in microseconds
+#define LCD_BLIT_QUEUE_DEPTH (8)        // number of blits that can wait to be sent (power of 2)
+#define LCD_GLYPH_CACHE_SIZE (16384)   // RAM budget for rendered glyphs in bytes
 
 // LCD command definitions
 #define LCD_CMD_NOP     (0x00)          // no operation
@@ -94,7 +96,10 @@ void lcd_write16_data(uint8_t len, ...);
 void lcd_write16_buf(const uint16_t *buffer, size_t len);
 
 // Display window and drawing functions
-void lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+uint32_t lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+bool lcd_blit_done(uint32_t ticket);
+void lcd_blit_wait(uint32_t ticket);
+void lcd_blit_fence(void);
 void lcd_solid_rectangle(uint16_t colour, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
 
 // Scrolling functions
@@ -107,6 +112,8 @@ void lcd_scroll_down(void);
 // Character and cursor functions
 void lcd_putc(uint8_t column, uint8_t row, uint8_t c);
 void lcd_putstr(uint8_t column, uint8_t row, const char *str);
+void lcd_putchars(uint8_t column, uint8_t row, const uint8_t *chars, uint8_t len);
+void lcd_get_glyph_cache_stats(uint32_t *hits, uint32_t *misses);
 void lcd_move_cursor(uint8_t x, uint8_t y);
 void lcd_draw_cursor(void);
 void lcd_erase_cursor(void);
@@ -117,3 +124,7 @@ bool lcd_cursor_enabled(void);
 void lcd_clear_screen(void);
 void lcd_erase_line(uint8_t row, uint8_t col_start, uint8_t col_end);
 void lcd_init(void);
+
+// Background processing
+void lcd_start_background(alarm_pool_t *pool);
+void lcd_stop_background(void);
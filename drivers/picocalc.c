@@ -1,28 +1,172 @@
 #include "stdio.h"
+#include "string.h"
 #include "pico/stdlib.h"
 #include "pico/stdio/driver.h"
+#include "pico/multicore.h"
 
 #include "audio.h"
 #include "display.h"
 #include "keyboard.h"
 #include "fat32.h"
+#include "lcd.h"
+#include "picocalc.h"
 #include "southbridge.h"
 
 // Callback for when characters become available
 static void (*chars_available_callback)(void *) = NULL;
 static void *chars_available_param = NULL;
 
+//
+//  Render worker
+//
+//  Optionally (PICOCALC_RENDER_WORKER), the display runs on core 1. Output is copied into a ring that core 1 reads,
+//  running the terminal emulation and drawing while core 0 carries on. Only core 0 writes
+//  the head and only core 1 writes the tail, so the ring needs no lock. When the ring is
+//  full, the output waits for core 1 to catch up.
+//
+//  Everything else that touches the display is handed to core 1 as a call that runs after
+//  the output before it, and the caller waits for it to finish.
+//
+
+static bool render_worker_running = false;
+static uint32_t render_stack[PICOCALC_RENDER_STACK_SIZE / sizeof(uint32_t)];
+
+static char out_ring[PICOCALC_OUT_RING_SIZE];
+static volatile uint32_t out_head = 0; // position after the newest byte (core 0)
+static volatile uint32_t out_tail = 0; // position of the oldest byte (core 1)
+
+static volatile render_function_t render_function = NULL; // call waiting for core 1
+static void *render_param = NULL;
+
+static void render_worker(void)
+{
+    // The cursor blink and the blit interrupt belong to the core that draws
+    lcd_start_background(alarm_pool_create_with_unused_hardware_alarm(4));
+
+    while (true)
+    {
+        uint32_t head = out_head;
+        uint32_t tail = out_tail;
+
+        if (head != tail)
+        {
+            __dmb(); // read the bytes only after the head that covers them
+
+            // Draw up to the end of the ring, the rest is drawn next time around
+            uint32_t start = tail % PICOCALC_OUT_RING_SIZE;
+            uint32_t length = MIN(head - tail, PICOCALC_OUT_RING_SIZE - start);
+            display_emit_buffer(&out_ring[start], length);
+
+            __dmb(); // finish with the bytes before giving them back
+            out_tail = tail + length;
+            __sev();
+        }
+        else if (render_function)
+        {
+            render_function(render_param);
+
+            __dmb();
+            render_function = NULL;
+            __sev();
+        }
+        else
+        {
+            __wfe(); // wait for core 0
+        }
+    }
+}
+
+// Run the display on core 1 (call once, after picocalc_init)
+void picocalc_start_render_worker(void)
+{
+    if (render_worker_running)
+    {
+        return;
+    }
+
+    lcd_stop_background();
+    multicore_launch_core1_with_stack(render_worker, render_stack, sizeof(render_stack));
+    render_worker_running = true;
+}
+
+// Call a function that uses the display, on core 1 after the output before it, and wait
+// for it to return
+void picocalc_render_call(render_function_t function, void *param)
+{
+    if (!render_worker_running)
+    {
+        function(param);
+        return;
+    }
+
+    render_param = param;
+    __dmb();
+    render_function = function;
+    __sev();
+
+    while (render_function)
+    {
+        __wfe();
+    }
+}
+
+static void render_fence(void *param)
+{
+    lcd_blit_fence();
+}
+
+static void render_review(void *param)
+{
+    display_review(*(int *)param);
+}
+
+static void render_review_end(void *param)
+{
+    display_review_end();
+}
+
 static void picocalc_out_chars(const char *buf, int length)
 {
-    for (int i = 0; i < length; ++i)
+    if (!render_worker_running)
+    {
+        display_emit_buffer(buf, length);
+        return;
+    }
+
+    while (length > 0)
     {
-        display_emit(buf[i]);
+        uint32_t head = out_head;
+        uint32_t space = PICOCALC_OUT_RING_SIZE - (head - out_tail);
+        if (space == 0)
+        {
+            __wfe(); // wait for core 1 to make room
+            continue;
+        }
+
+        // Copy up to the end of the ring, the rest goes around next time
+        uint32_t start = head % PICOCALC_OUT_RING_SIZE;
+        uint32_t count = MIN(MIN(space, PICOCALC_OUT_RING_SIZE - start), (uint32_t)length);
+        memcpy(&out_ring[start], buf, count);
+
+        __dmb(); // write the bytes before the head that covers them
+        out_head = head + count;
+        __sev();
+
+        buf += count;
+        length -= count;
     }
 }
 
+// Wait until all the output is on the display
+void picocalc_render_fence(void)
+{
+    picocalc_render_call(render_fence, NULL);
+}
+
+// Output in the ring is as good as written, stdio flushes after every printf and must
+// not wait for the drawing (use picocalc_render_fence for that)
 static void picocalc_out_flush(void)
 {
-    // No flush needed for this driver
 }
 
 static int picocalc_in_chars(char *buf, int length)
@@ -30,9 +174,25 @@ static int picocalc_in_chars(char *buf, int length)
     int n = 0;
     while (n < length)
     {
-        int c = keyboard_get_key();
-        if (c == -1)
+        if (!keyboard_key_available())
             break; // No key pressed
+        int c = keyboard_get_key();
+        if ((uint8_t)c == KEY_SHIFT_PAGE_UP)
+        {
+            int lines = DISPLAY_REVIEW_PAGE; // back through the scrollback
+            picocalc_render_call(render_review, &lines);
+            continue;
+        }
+        if ((uint8_t)c == KEY_SHIFT_PAGE_DOWN)
+        {
+            int lines = -DISPLAY_REVIEW_PAGE; // forward to the live screen
+            picocalc_render_call(render_review, &lines);
+            continue;
+        }
+        if (display_is_reviewing())
+        {
+            picocalc_render_call(render_review_end, NULL); // any other key returns to the live screen
+        }
         buf[n++] = (char)c;
     }
     return n;
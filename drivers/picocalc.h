@@ -4,10 +4,21 @@
 
 #include "pico/stdio/driver.h"
 
+// Render worker
+#ifndef PICOCALC_RENDER_WORKER
+#define PICOCALC_RENDER_WORKER      (false) // draw the output on core 1 (can be set by the build)
+#endif
+#define PICOCALC_OUT_RING_SIZE      (4096)  // bytes of output waiting for core 1 (a power of two)
+#define PICOCALC_RENDER_STACK_SIZE  (4096)  // bytes of stack for the render worker on core 1
+
 typedef void (*led_callback_t)(uint8_t);
+typedef void (*render_function_t)(void *);
 
 extern stdio_driver_t picocalc_stdio_driver;
 
 // Function prototypes
 void picocalc_chars_available_notify(void);
+void picocalc_start_render_worker(void);
+void picocalc_render_call(render_function_t function, void *param);
+void picocalc_render_fence(void);
 void picocalc_init(void);
@@ -62,20 +62,30 @@ static void sd_spi_read_buf(uint8_t *dst, size_t len)
 
 static bool sd_wait_ready(void)
 {
-    uint8_t response;
-    uint32_t timeout = 10000; // Add timeout to prevent infinite loop
-    do
+    // The card holds MISO low while it is busy programming
+    absolute_time_t timeout = make_timeout_time_ms(SD_BUSY_TIMEOUT_MS);
+    while (sd_spi_write_read(0xFF) != 0xFF)
     {
-        response = sd_spi_write_read(0xFF);
-        timeout--;
-        if (timeout == 0)
+        if (time_reached(timeout))
         {
             return false; // Timeout occurred
         }
-    } while (response != 0xFF);
+    }
     return true; // Success
 }
 
+static bool sd_wait_data_token(void)
+{
+    uint8_t response;
+    uint32_t timeout = 100000;
+    do
+    {
+        response = sd_spi_write_read(0xFF);
+        timeout--;
+    } while (response != SD_DATA_START_BLOCK && timeout > 0);
+    return response == SD_DATA_START_BLOCK;
+}
+
 static uint8_t sd_send_command(uint8_t cmd, uint32_t arg)
 {
     uint8_t response;
@@ -105,6 +115,11 @@ static uint8_t sd_send_command(uint8_t cmd, uint32_t arg)
     sd_cs_select();
     sd_spi_write_buf(packet, 6);
 
+    if (cmd == SD_CMD12)
+    {
+        sd_spi_write_read(0xFF); // Discard the stuff byte that follows CMD12
+    }
+
     // Wait for response (R1) - but with timeout
     response = 0xFF;
     do
@@ -146,14 +161,7 @@ sd_error_t sd_read_block(uint32_t block, uint8_t *buffer)
     }
 
     // Wait for data token
-    uint32_t timeout = 100000;
-    do
-    {
-        response = sd_spi_write_read(0xFF);
-        timeout--;
-    } while (response != SD_DATA_START_BLOCK && timeout > 0);
-
-    if (timeout == 0)
+    if (!sd_wait_data_token())
     {
         sd_cs_deselect();
         return SD_ERROR_READ_FAILED;
@@ -207,30 +215,147 @@ sd_error_t sd_write_block(uint32_t block, const uint8_t *buffer)
     return SD_OK;
 }
 
-sd_error_t sd_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer)
+// Stream blocks under a single READ_MULTIPLE_BLOCK command, either into
+// consecutive parts of the buffer or, with a callback, each into the start
+// of the buffer and handed to the callback before the next arrives
+static sd_error_t sd_read_multiple(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer,
+                                   sd_block_callback_t callback, void *param)
 {
+    uint32_t addr = is_sdhc ? start_block : start_block * SD_BLOCK_SIZE;
+    uint8_t response = sd_send_command(SD_CMD18, addr);
+    if (response != 0)
+    {
+        sd_cs_deselect();
+        return SD_ERROR_READ_FAILED;
+    }
+
+    sd_error_t result = SD_OK;
     for (uint32_t i = 0; i < num_blocks; i++)
     {
-        sd_error_t result = sd_read_block(start_block + i, buffer + (i * SD_BLOCK_SIZE));
-        if (result != SD_OK)
+        // Each block has its own data token
+        if (!sd_wait_data_token())
+        {
+            result = SD_ERROR_READ_FAILED;
+            break;
+        }
+
+        // Read data
+        uint8_t *block = callback ? buffer : buffer + (i * SD_BLOCK_SIZE);
+        sd_spi_read_buf(block, SD_BLOCK_SIZE);
+
+        // Read CRC (ignore it)
+        sd_spi_write_read(0xFF);
+        sd_spi_write_read(0xFF);
+
+        if (callback)
         {
-            return result;
+            callback(i, block, param);
         }
     }
-    return SD_OK;
+
+    // Stop the transmission, CS is still selected
+    response = sd_send_command(SD_CMD12, 0);
+    if (response != 0)
+    {
+        result = SD_ERROR_READ_FAILED;
+    }
+    sd_wait_ready(); // The card signals busy after CMD12
+    sd_cs_deselect();
+
+    return result;
+}
+
+sd_error_t sd_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer)
+{
+    if (num_blocks == 1)
+    {
+        return sd_read_block(start_block, buffer);
+    }
+    if (num_blocks == 0)
+    {
+        return SD_OK;
+    }
+
+    return sd_read_multiple(start_block, num_blocks, buffer, NULL, NULL);
+}
+
+sd_error_t sd_read_blocks_each(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer,
+                               sd_block_callback_t callback, void *param)
+{
+    if (num_blocks == 0)
+    {
+        return SD_OK;
+    }
+
+    return sd_read_multiple(start_block, num_blocks, buffer, callback, param);
 }
 
 sd_error_t sd_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer)
 {
+    if (num_blocks == 1)
+    {
+        return sd_write_block(start_block, buffer);
+    }
+    if (num_blocks == 0)
+    {
+        return SD_OK;
+    }
+
+    uint8_t response;
+    if (SD_WRITE_PRE_ERASE)
+    {
+        // Tell the card how many blocks are coming so it can erase them up
+        // front, this is only a hint so failures are ignored
+        response = sd_send_command(SD_CMD55, 0);
+        sd_cs_deselect();
+        if (response <= 1)
+        {
+            sd_send_command(SD_ACMD23, num_blocks);
+            sd_cs_deselect();
+        }
+    }
+
+    // Send all of the blocks under a single WRITE_MULTIPLE_BLOCK command
+    uint32_t addr = is_sdhc ? start_block : start_block * SD_BLOCK_SIZE;
+    response = sd_send_command(SD_CMD25, addr);
+    if (response != 0)
+    {
+        sd_cs_deselect();
+        return SD_ERROR_WRITE_FAILED;
+    }
+
+    sd_error_t result = SD_OK;
     for (uint32_t i = 0; i < num_blocks; i++)
     {
-        sd_error_t result = sd_write_block(start_block + i, buffer + (i * SD_BLOCK_SIZE));
-        if (result != SD_OK)
+        // Send data token
+        sd_spi_write_read(SD_DATA_START_BLOCK_MULT);
+
+        // Send data
+        sd_spi_write_buf(buffer + (i * SD_BLOCK_SIZE), SD_BLOCK_SIZE);
+
+        // Send dummy CRC
+        sd_spi_write_read(0xFF);
+        sd_spi_write_read(0xFF);
+
+        // Check data response, then wait for the block to be programmed
+        response = sd_spi_write_read(0xFF) & 0x1F;
+        if (response != 0x05 || !sd_wait_ready())
         {
-            return result;
+            result = SD_ERROR_WRITE_FAILED;
+            break;
         }
     }
-    return SD_OK;
+
+    // The stop token ends the transfer, the card is busy once more
+    sd_spi_write_read(SD_DATA_STOP_MULT);
+    sd_spi_write_read(0xFF);
+    if (!sd_wait_ready())
+    {
+        result = SD_ERROR_WRITE_FAILED;
+    }
+    sd_cs_deselect();
+
+    return result;
 }
 
 //
@@ -16,6 +16,8 @@
 // SD card interface definitions
 #define SD_INIT_BAUDRATE (400000) // 400 KHz SPI clock speed for initialization
 #define SD_BAUDRATE (25000000) // 25 MHz SPI clock speed (SD spec max for SPI mode)
+#define SD_BUSY_TIMEOUT_MS (500)  // Longest a card may stay busy after a write (SDXC limit)
+#define SD_WRITE_PRE_ERASE (true) // Send ACMD23 before multi-block writes so the card can pre-erase
 
 // SD card commands
 #define SD_CMD0 (0)    // GO_IDLE_STATE
@@ -60,6 +62,9 @@ typedef enum
     SD_ERROR_WRITE_FAILED,
 } sd_error_t;
 
+// Callback function type for each block of a streamed read
+typedef void (*sd_block_callback_t)(uint32_t index, const uint8_t *block, void *param);
+
 
 // Function prototypes
 
@@ -74,6 +79,8 @@ sd_error_t sd_read_block(uint32_t block, uint8_t *buffer);
 sd_error_t sd_write_block(uint32_t block, const uint8_t *buffer);
 sd_error_t sd_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer);
 sd_error_t sd_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer);
+sd_error_t sd_read_blocks_each(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer,
+                               sd_block_callback_t callback, void *param);
 
 // Utility functions
 const char *sd_error_string(sd_error_t error);
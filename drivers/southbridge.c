@@ -5,223 +5,431 @@
 //  that provides access to the keyboard, battery, and other peripherals.
 //
 
-#include <stdatomic.h>
+#include <string.h>
 
 #include "pico/stdlib.h"
 #include "pico/platform.h"
-#include "pico/multicore.h"
 #include "hardware/gpio.h"
 #include "hardware/i2c.h"
+#include "hardware/irq.h"
 
 #include "southbridge.h"
 
 static bool sb_initialised = false;
-volatile atomic_bool sb_i2c_in_use = false; // flag to indicate if I2C bus is in use
 
 //
-//  Protect access to the "South Bridge"
+//  Transfer queue
 //
+//  Requests to the southbridge are queued and sent by the I2C interrupt, one after another,
+//  so nothing waits on the slow bus. A request writes a command and, optionally, reads the
+//  response in a second transfer. When a request completes, its callback is called from
+//  the interrupt and the next request is chosen by priority, and then in the order they
+//  were queued, so that the keyboard is always read first.
+//
+//  A request that does not complete in time is aborted, and if the bus still does not
+//  stop, the controller is reset and the request fails.
+//
+
+#define SB_SLOT_FREE   (0) // slot is free
+#define SB_SLOT_QUEUED (1) // request is waiting for the bus
+#define SB_SLOT_ACTIVE (2) // request is on the bus
 
-//  Is the southbridge available?
-bool sb_available()
+typedef struct
 {
-    return atomic_load(&sb_i2c_in_use) == false;
+    uint8_t state;                      // free, queued or active
+    uint8_t priority;                   // lower is sooner
+    uint32_t sequence;                  // order in which it was queued
+    uint8_t command[SB_COMMAND_SIZE];   // bytes to write
+    uint8_t command_length;             // number of bytes to write
+    uint8_t response[SB_RESPONSE_SIZE]; // bytes read
+    uint8_t response_length;            // number of bytes to read
+    sb_callback_t callback;             // called when the request completes
+    void *param;                        // passed to the callback
+} sb_request_t;
+
+static sb_request_t sb_queue[SB_QUEUE_DEPTH];
+static sb_request_t *sb_current = NULL; // request on the bus
+static uint32_t sb_sequence = 0;        // sequence of the next request queued
+static bool sb_reading = false;         // the command is written and the response is being read
+static bool sb_aborted = false;         // the controller aborted the transfer
+static bool sb_timed_out = false;       // the transfer took too long and was aborted
+static bool sb_completing = false;      // a callback is running, the next request is chosen after it
+static alarm_id_t sb_timeout_alarm = 0;
+
+static int64_t sb_on_timeout(alarm_id_t id, void *param);
+
+// Queue the bytes to write, or the reads, for a transfer that ends with a stop
+static void sb_start_transfer(const uint8_t *command, uint8_t length)
+{
+    i2c_hw_t *hw = i2c_get_hw(SB_I2C);
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        uint32_t stop = (i == length - 1) ? I2C_IC_DATA_CMD_STOP_BITS : 0;
+        hw->data_cmd = (command ? command[i] : I2C_IC_DATA_CMD_CMD_BITS) | stop;
+    }
 }
 
-static size_t sb_write(const uint8_t *src, size_t len)
+// Start the next request, if the bus is idle (interrupts must be disabled)
+static void sb_start_next(void)
 {
-    int result = i2c_write_timeout_us(SB_I2C, SB_ADDR, src, len, false, SB_I2C_TIMEOUT_US * len);
-    if (result == PICO_ERROR_GENERIC || result == PICO_ERROR_TIMEOUT)
+    if (sb_current || sb_completing)
     {
-        // Write error
-        return 0;
+        return;
+    }
+
+    sb_request_t *next = NULL;
+    for (int i = 0; i < SB_QUEUE_DEPTH; i++)
+    {
+        sb_request_t *request = &sb_queue[i];
+        if (request->state == SB_SLOT_QUEUED &&
+            (!next || request->priority < next->priority ||
+             (request->priority == next->priority && (int32_t)(request->sequence - next->sequence) < 0)))
+        {
+            next = request;
+        }
     }
-    return result;
+
+    if (!next)
+    {
+        return;
+    }
+
+    next->state = SB_SLOT_ACTIVE;
+    sb_current = next;
+    sb_reading = false;
+    sb_aborted = false;
+    sb_timed_out = false;
+
+    uint32_t timeout_us = SB_I2C_TIMEOUT_US * (next->command_length + next->response_length);
+    sb_timeout_alarm = add_alarm_in_us(timeout_us, sb_on_timeout, (void *)(uintptr_t)next->sequence, true);
+    sb_start_transfer(next->command, next->command_length);
 }
 
-static size_t sb_read(uint8_t *dst, size_t len)
+// Finish the request on the bus, call its callback and start the next
+static void sb_complete(bool ok)
 {
-    int result = i2c_read_timeout_us(SB_I2C, SB_ADDR, dst, len, false, SB_I2C_TIMEOUT_US * len);
-    if (result == PICO_ERROR_GENERIC || result == PICO_ERROR_TIMEOUT)
+    sb_request_t *request = sb_current;
+
+    if (sb_timeout_alarm > 0)
     {
-        // Read error
-        return 0;
+        cancel_alarm(sb_timeout_alarm);
     }
-    return result;
+    sb_timeout_alarm = 0;
+    sb_current = NULL;
+
+    // The slot is free once the callback has the response
+    sb_completing = true;
+    if (request->callback)
+    {
+        request->callback(ok, request->response, request->param);
+    }
+    request->state = SB_SLOT_FREE;
+    sb_completing = false;
+
+    sb_start_next();
 }
 
-// Read the keyboard
-uint16_t sb_read_keyboard()
+static void sb_irq_handler(void)
 {
-    uint8_t buffer[2];
+    i2c_hw_t *hw = i2c_get_hw(SB_I2C);
+    uint32_t status = hw->intr_stat;
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_FIF;             // command to check if key is available
-    if (sb_write(buffer, 1) != 1)
+    if (status & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        (void)hw->clr_tx_abrt;
+        sb_aborted = true; // the controller sends a stop after an abort
     }
-    if (sb_read(buffer, 2) != 2)
+
+    if (!(status & I2C_IC_INTR_STAT_R_STOP_DET_BITS))
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        return;
     }
-    atomic_store(&sb_i2c_in_use, false);
+    (void)hw->clr_stop_det;
 
-    return buffer[0] << 8 | buffer[1];
+    if (!sb_current)
+    {
+        return;
+    }
+
+    if (!sb_aborted && !sb_reading && sb_current->response_length > 0)
+    {
+        // The command is written, read the response
+        sb_reading = true;
+        sb_start_transfer(NULL, sb_current->response_length);
+        return;
+    }
+
+    uint8_t count = 0;
+    while (hw->rxflr > 0)
+    {
+        uint8_t value = (uint8_t)hw->data_cmd;
+        if (count < sb_current->response_length)
+        {
+            sb_current->response[count++] = value;
+        }
+    }
+
+    sb_complete(!sb_aborted && count == sb_current->response_length);
 }
 
-uint16_t sb_read_keyboard_state()
+static int64_t sb_on_timeout(alarm_id_t id, void *param)
 {
-    uint8_t buffer[2];
+    i2c_hw_t *hw = i2c_get_hw(SB_I2C);
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_KEY;             // command to read key state
-    if (sb_write(buffer, 1) != 1)
+    if (!sb_current || sb_current->sequence != (uint32_t)(uintptr_t)param)
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        return 0; // the request completed
     }
-    if (sb_read(buffer, 2) != 2)
+
+    if (!sb_timed_out)
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        // Ask the controller to abort, which completes the request with a stop
+        sb_timed_out = true;
+        hw->enable |= I2C_IC_ENABLE_ABORT_BITS;
+        return SB_I2C_TIMEOUT_US;
     }
-    atomic_store(&sb_i2c_in_use, false);
 
-    return buffer[0];
+    // The bus did not stop, reset the controller and give up
+    hw->enable = 0;
+    hw->enable = I2C_IC_ENABLE_ENABLE_BITS;
+    sb_timeout_alarm = 0;
+    sb_complete(false);
+    return 0;
 }
 
-// Read the battery level from the southbridge
-uint8_t sb_read_battery()
+// Queue a request, returning false if the queue is full
+bool sb_submit(uint8_t priority, const uint8_t *command, uint8_t command_length, uint8_t response_length,
+               sb_callback_t callback, void *param)
 {
-    uint8_t buffer[2];
+    if (command_length == 0 || command_length > SB_COMMAND_SIZE || response_length > SB_RESPONSE_SIZE)
+    {
+        return false;
+    }
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_BAT; // command to read battery level
-    if (sb_write(buffer, 1) != 1)
+    uint32_t state = save_and_disable_interrupts();
+
+    sb_request_t *request = NULL;
+    for (int i = 0; i < SB_QUEUE_DEPTH; i++)
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        if (sb_queue[i].state == SB_SLOT_FREE)
+        {
+            request = &sb_queue[i];
+            break;
+        }
     }
-    if (sb_read(buffer, 2) != 2)
+
+    if (!request)
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        restore_interrupts(state);
+        return false;
     }
-    atomic_store(&sb_i2c_in_use, false);
 
-    return buffer[1];
+    request->state = SB_SLOT_QUEUED;
+    request->priority = priority;
+    request->sequence = sb_sequence++;
+    memcpy(request->command, command, command_length);
+    request->command_length = command_length;
+    request->response_length = response_length;
+    request->callback = callback;
+    request->param = param;
+
+    sb_start_next();
+
+    restore_interrupts(state);
+    return true;
 }
 
-// Read the LCD backlight level
-uint8_t sb_read_lcd_backlight()
+//
+//  Synchronous requests
+//
+//  The functions below wait for their request to complete. The core sleeps while the
+//  interrupt drives the bus, and the keyboard is still read first. They must not be
+//  called from an interrupt.
+//
+
+typedef struct
 {
-    uint8_t buffer[2];
+    volatile bool done; // the request has completed
+    bool ok;            // the request succeeded
+    uint8_t *response;  // where to copy the response
+    uint8_t length;     // number of bytes in the response
+} sb_wait_t;
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_BKL; // command to read LCD backlight
-    if (sb_write(buffer, 1) != 1)
+static void sb_on_wait(bool ok, const uint8_t *response, void *param)
+{
+    sb_wait_t *wait = (sb_wait_t *)param;
+
+    wait->ok = ok;
+    if (ok && wait->length > 0)
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        memcpy(wait->response, response, wait->length);
     }
-    if (sb_read(buffer, 2) != 2)
+    wait->done = true;
+    __sev();
+}
+
+// Send a command and wait for the response
+static bool sb_transfer(const uint8_t *command, uint8_t command_length, uint8_t *response, uint8_t response_length)
+{
+    sb_wait_t wait = {.response = response, .length = response_length};
+
+    while (!sb_submit(SB_PRIORITY_NORMAL, command, command_length, response_length, sb_on_wait, &wait))
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        __wfe(); // the queue is full, wait for a request to complete
+    }
+    while (!wait.done)
+    {
+        __wfe();
     }
-    atomic_store(&sb_i2c_in_use, false);
 
-    return buffer[1];
+    return wait.ok;
 }
 
-// Write the LCD backlight level
-uint8_t sb_write_lcd_backlight(uint8_t brightness)
+//
+//  Register cache
+//
+//  The battery and backlight levels are kept for SB_CACHE_TTL_MS after they are read or
+//  written, so repeated reads do not use the bus.
+//
+
+typedef struct
 {
-    uint8_t buffer[2];
+    uint8_t reg;             // register cached
+    bool valid;              // the value has been read
+    uint8_t value;           // last value read or written
+    absolute_time_t expires; // when the value must be read again
+} sb_cache_entry_t;
+
+static sb_cache_entry_t sb_cache[] = {
+    {.reg = SB_REG_BAT},
+    {.reg = SB_REG_BKL},
+    {.reg = SB_REG_BK2},
+};
+
+static sb_cache_entry_t *sb_cache_find(uint8_t reg)
+{
+    for (size_t i = 0; i < count_of(sb_cache); i++)
+    {
+        if (sb_cache[i].reg == reg)
+        {
+            return &sb_cache[i];
+        }
+    }
+    return NULL;
+}
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_BKL | SB_WRITE; // command to write LCD backlight
-    buffer[1] = brightness;
-    if (sb_write(buffer, 2) != 2)
+static void sb_cache_store(uint8_t reg, uint8_t value)
+{
+    sb_cache_entry_t *entry = sb_cache_find(reg);
+
+    entry->value = value;
+    entry->expires = make_timeout_time_ms(SB_CACHE_TTL_MS);
+    entry->valid = true;
+}
+
+// Read a register, from the cache while it is fresh
+static uint8_t sb_read_cached(uint8_t reg)
+{
+    sb_cache_entry_t *entry = sb_cache_find(reg);
+    if (entry->valid && !time_reached(entry->expires))
     {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
+        return entry->value;
     }
-    if (sb_read(buffer, 2) != 2)
+
+    uint8_t buffer[2];
+    buffer[0] = reg;
+    if (!sb_transfer(buffer, 1, buffer, 2))
     {
-        atomic_store(&sb_i2c_in_use, false);
         return 0;
     }
-    atomic_store(&sb_i2c_in_use, false);
 
+    sb_cache_store(reg, buffer[1]);
     return buffer[1];
 }
 
-// Read the keyboard backlight level
-uint8_t sb_read_keyboard_backlight()
+// Write a register and keep the value the southbridge reports
+static uint8_t sb_write_cached(uint8_t reg, uint8_t value)
 {
     uint8_t buffer[2];
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_BK2; // command to read keyboard backlight
-    if (sb_write(buffer, 1) != 1)
+    buffer[0] = reg | SB_WRITE;
+    buffer[1] = value;
+    if (!sb_transfer(buffer, 2, buffer, 2))
     {
-        atomic_store(&sb_i2c_in_use, false);
         return 0;
     }
-    if (sb_read(buffer, 2) != 2)
-    {
-        atomic_store(&sb_i2c_in_use, false);
-        return 0;
-    }
-    atomic_store(&sb_i2c_in_use, false);
 
+    sb_cache_store(reg, buffer[1]);
     return buffer[1];
 }
 
-// Write the keyboard backlight level
-uint8_t sb_write_keyboard_backlight(uint8_t brightness)
+// Read the keyboard
+uint16_t sb_read_keyboard()
 {
     uint8_t buffer[2];
 
-    atomic_store(&sb_i2c_in_use, true);
-    buffer[0] = SB_REG_BK2 | SB_WRITE; // command to write keyboard backlight
-    buffer[1] = brightness;
-    if (sb_write(buffer, 2) != 2)
+    buffer[0] = SB_REG_FIF; // command to check if key is available
+    if (!sb_transfer(buffer, 1, buffer, 2))
     {
-        atomic_store(&sb_i2c_in_use, false);
         return 0;
     }
-    if (sb_read(buffer, 2) != 2)
+
+    return buffer[0] << 8 | buffer[1];
+}
+
+uint16_t sb_read_keyboard_state()
+{
+    uint8_t buffer[2];
+
+    buffer[0] = SB_REG_KEY; // command to read key state
+    if (!sb_transfer(buffer, 1, buffer, 2))
     {
-        atomic_store(&sb_i2c_in_use, false);
         return 0;
     }
-    atomic_store(&sb_i2c_in_use, false);
 
     return buffer[1];
 }
 
+// Read the battery level from the southbridge
+uint8_t sb_read_battery()
+{
+    return sb_read_cached(SB_REG_BAT);
+}
+
+// Read the LCD backlight level
+uint8_t sb_read_lcd_backlight()
+{
+    return sb_read_cached(SB_REG_BKL);
+}
+
+// Write the LCD backlight level
+uint8_t sb_write_lcd_backlight(uint8_t brightness)
+{
+    return sb_write_cached(SB_REG_BKL, brightness);
+}
+
+// Read the keyboard backlight level
+uint8_t sb_read_keyboard_backlight()
+{
+    return sb_read_cached(SB_REG_BK2);
+}
+
+// Write the keyboard backlight level
+uint8_t sb_write_keyboard_backlight(uint8_t brightness)
+{
+    return sb_write_cached(SB_REG_BK2, brightness);
+}
+
 bool sb_is_power_off_supported()
 {
     uint8_t buffer[2];
 
-    atomic_store(&sb_i2c_in_use, true);
     buffer[0] = SB_REG_OFF; // read the power-off register
-    if (sb_write(buffer, 1) != 1)
-    {
-        atomic_store(&sb_i2c_in_use, false);
-        return false;
-    }
-    if (sb_read(buffer, 2) != 2)
+    if (!sb_transfer(buffer, 1, buffer, 2))
     {
-        atomic_store(&sb_i2c_in_use, false);
         return false;
     }
-    atomic_store(&sb_i2c_in_use, false);
 
     return buffer[1] > 0;
 }
@@ -230,37 +438,18 @@ bool sb_write_power_off_delay(uint8_t delay_seconds)
 {
     uint8_t buffer[2];
 
-    atomic_store(&sb_i2c_in_use, true);
     buffer[0] = SB_REG_OFF | SB_WRITE; // command to write power-off delay
     buffer[1] = delay_seconds;
-    if (sb_write(buffer, 2) != 2)
-    {
-        atomic_store(&sb_i2c_in_use, false);
-        return false;
-    }
-    atomic_store(&sb_i2c_in_use, false);
-    return true;
+    return sb_transfer(buffer, 2, NULL, 0);
 }
 
 bool sb_reset(uint8_t delay_seconds)
 {
     uint8_t buffer[2];
 
-    atomic_store(&sb_i2c_in_use, true);
     buffer[0] = SB_REG_RST | SB_WRITE; // command to reset the PicoCalc
     buffer[1] = delay_seconds;
-    if (sb_write(buffer, 2) != 2)
-    {
-        atomic_store(&sb_i2c_in_use, false);
-        return false;
-    }
-    if (sb_read(buffer, 2) != 2)
-    {
-        atomic_store(&sb_i2c_in_use, false);
-        return false;
-    }
-    atomic_store(&sb_i2c_in_use, false);
-    return true;
+    return sb_transfer(buffer, 2, buffer, 2);
 }
 
 // Initialize the southbridge
@@ -277,6 +466,17 @@ void sb_init()
     gpio_pull_up(SB_SCL);
     gpio_pull_up(SB_SDA);
 
+    // The southbridge is the only device on the bus
+    i2c_hw_t *hw = i2c_get_hw(SB_I2C);
+    hw->enable = 0;
+    hw->tar = SB_ADDR;
+    hw->enable = I2C_IC_ENABLE_ENABLE_BITS;
+
+    // Transfers are driven by the stop at the end of each one
+    hw->intr_mask = I2C_IC_INTR_MASK_M_STOP_DET_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
+    irq_set_exclusive_handler(I2C0_IRQ + i2c_get_index(SB_I2C), sb_irq_handler);
+    irq_set_enabled(I2C0_IRQ + i2c_get_index(SB_I2C), true);
+
     // Set the initialised flag
     sb_initialised = true;
 }
@@ -14,6 +14,14 @@
 #define SB_ADDR            (0x1F)
 #define SB_I2C_TIMEOUT_US (10000)
 
+// Transfer queue definitions
+#define SB_QUEUE_DEPTH       (8)    // requests that can wait for the bus
+#define SB_COMMAND_SIZE      (2)    // largest command written
+#define SB_RESPONSE_SIZE     (2)    // largest response read
+#define SB_PRIORITY_KEYBOARD (0)    // keyboard requests go first
+#define SB_PRIORITY_NORMAL   (1)    // everything else
+#define SB_CACHE_TTL_MS      (2000) // battery and backlight levels are read again after 2 seconds
+
 
 // Keyboard register definitions
 #define SB_REG_KEY         (0x04)      // *key status
@@ -26,9 +34,17 @@
 
 #define SB_WRITE           (0x80)      // write to register
 
+// Key status register bits
+#define SB_KEY_COUNT_MASK  (0x1F)      // number of key events in the FIFO
+#define SB_KEY_CAPS_LOCK   (0x20)      // caps lock is on
+
+// Called when a request completes, from the I2C interrupt
+typedef void (*sb_callback_t)(bool ok, const uint8_t *response, void *param);
+
 // Function prototypes
 void sb_init(void);
-bool sb_available(void);
+bool sb_submit(uint8_t priority, const uint8_t *command, uint8_t command_length, uint8_t response_length,
+               sb_callback_t callback, void *param);
 
 uint16_t sb_read_keyboard(void);
 uint16_t sb_read_keyboard_state(void);
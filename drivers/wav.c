@@ -0,0 +1,387 @@
+//
+//  PicoCalc WAV Driver
+//
+//  This driver streams 8 or 16-bit PCM WAV files from the SD card to the
+//  sampled audio, without loading the file into RAM.
+//
+//  The samples are read ahead into a ring of sector-sized buffers. After the
+//  first read, which stops at the next sector boundary, every read is of a whole
+//  sector at a sector-aligned position in the file. wav_service fills the ring
+//  from the main loop and the audio interrupt empties it, converting the samples
+//  to frames as it goes. Only the main loop moves the head and only the interrupt
+//  moves the tail, so no locks are needed.
+//
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "wav.h"
+
+static fat32_file_t wav_file;
+static bool wav_file_open = false;
+static bool wav_playing = false;       // the sampled audio was started for this file
+static wav_format_t wav_format;
+static uint16_t wav_block_align = 0;   // bytes in each frame
+static uint32_t wav_data_remaining = 0; // bytes of the data chunk still to read
+
+// Read-ahead ring
+static uint8_t wav_buffers[WAV_BUFFER_COUNT][WAV_BUFFER_SIZE] __attribute__((aligned(4)));
+static uint16_t wav_lengths[WAV_BUFFER_COUNT];
+static volatile uint32_t wav_head = 0;     // buffers filled, moved by wav_service
+static volatile uint32_t wav_tail = 0;     // buffers emptied, moved by the audio
+static uint16_t wav_offset = 0;            // next byte in the buffer at the tail
+static volatile bool wav_read_done = false; // the whole data chunk is in the ring
+
+// Telemetry
+static volatile uint32_t wav_underruns = 0;
+static uint32_t wav_reads = 0;
+static uint32_t wav_bytes_read = 0;
+static uint32_t wav_read_us = 0;
+static uint32_t wav_max_read_us = 0;
+static volatile uint8_t wav_min_fill = WAV_BUFFER_COUNT;
+static volatile uint32_t wav_fill_sum = 0;
+static volatile uint32_t wav_fill_count = 0;
+
+
+//
+// Header
+//
+
+static inline uint16_t read_le16(const uint8_t *bytes)
+{
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static inline uint32_t read_le32(const uint8_t *bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static bool read_exactly(void *buffer, size_t size)
+{
+    size_t bytes_read;
+    return fat32_read(&wav_file, buffer, size, &bytes_read) == FAT32_OK && bytes_read == size;
+}
+
+// Find the format and data chunks, leaving the file at the start of the samples
+static wav_error_t wav_parse_header(uint32_t *data_size)
+{
+    uint8_t header[16];
+    uint16_t format_tag = 0;
+    bool found_format = false;
+
+    if (!read_exactly(header, 12) ||
+        memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+    {
+        return WAV_ERROR_FORMAT;
+    }
+
+    while (true)
+    {
+        if (!read_exactly(header, 8))
+        {
+            return WAV_ERROR_FORMAT; // no data chunk
+        }
+
+        uint32_t chunk_size = read_le32(header + 4);
+        uint32_t chunk_start = fat32_tell(&wav_file);
+
+        if (memcmp(header, "data", 4) == 0)
+        {
+            if (!found_format)
+            {
+                return WAV_ERROR_FORMAT;
+            }
+            *data_size = chunk_size;
+            break;
+        }
+
+        if (memcmp(header, "fmt ", 4) == 0)
+        {
+            if (chunk_size < 16 || !read_exactly(header, 16))
+            {
+                return WAV_ERROR_FORMAT;
+            }
+            format_tag = read_le16(header);
+            wav_format.channels = read_le16(header + 2);
+            wav_format.sample_rate = read_le32(header + 4);
+            wav_block_align = read_le16(header + 12);
+            wav_format.bits_per_sample = read_le16(header + 14);
+            found_format = true;
+        }
+
+        // Chunks are padded to an even length
+        if (fat32_seek(&wav_file, chunk_start + chunk_size + (chunk_size & 1)) != FAT32_OK)
+        {
+            return WAV_ERROR_FORMAT;
+        }
+    }
+
+    if (format_tag != 1 ||
+        (wav_format.channels != 1 && wav_format.channels != 2) ||
+        (wav_format.bits_per_sample != 8 && wav_format.bits_per_sample != 16) ||
+        wav_block_align != wav_format.channels * wav_format.bits_per_sample / 8 ||
+        wav_format.sample_rate < AUDIO_PCM_MIN_RATE || wav_format.sample_rate > AUDIO_PCM_MAX_RATE)
+    {
+        return WAV_ERROR_UNSUPPORTED;
+    }
+
+    return WAV_OK;
+}
+
+
+//
+// Ring
+//
+
+// Take the next byte from the tail of the ring, which must not be empty
+static inline uint8_t wav_next_byte(void)
+{
+    uint32_t index = wav_tail % WAV_BUFFER_COUNT;
+    uint8_t value = wav_buffers[index][wav_offset++];
+
+    if (wav_offset == wav_lengths[index])
+    {
+        wav_offset = 0;
+        __dmb(); // finish with the buffer before handing it back
+        wav_tail = wav_tail + 1;
+    }
+    return value;
+}
+
+// Convert the next sample to a level
+static inline uint16_t wav_next_level(void)
+{
+    if (wav_format.bits_per_sample == 8)
+    {
+        return wav_next_byte() << (AUDIO_PCM_BITS - 8); // unsigned
+    }
+
+    uint16_t sample = wav_next_byte();
+    sample |= wav_next_byte() << 8;
+    return (uint16_t)(sample ^ 0x8000) >> (16 - AUDIO_PCM_BITS); // signed
+}
+
+// Fill the ring from the card, a sector at a time
+void wav_service(void)
+{
+    while (wav_file_open && !wav_read_done && wav_head - wav_tail < WAV_BUFFER_COUNT)
+    {
+        uint32_t index = wav_head % WAV_BUFFER_COUNT;
+        uint32_t size = WAV_BUFFER_SIZE - fat32_tell(&wav_file) % WAV_BUFFER_SIZE;
+        if (size > wav_data_remaining)
+        {
+            size = wav_data_remaining;
+        }
+
+        size_t bytes_read = 0;
+        uint32_t start = time_us_32();
+        fat32_error_t result = fat32_read(&wav_file, wav_buffers[index], size, &bytes_read);
+        uint32_t elapsed = time_us_32() - start;
+
+        if (result != FAT32_OK || bytes_read == 0)
+        {
+            wav_read_done = true; // play what has been read
+            break;
+        }
+
+        wav_reads++;
+        wav_bytes_read += bytes_read;
+        wav_read_us += elapsed;
+        if (elapsed > wav_max_read_us)
+        {
+            wav_max_read_us = elapsed;
+        }
+
+        wav_lengths[index] = bytes_read;
+        wav_data_remaining -= bytes_read;
+        __dmb(); // fill the buffer before handing it over
+        wav_head = wav_head + 1;
+
+        if (wav_data_remaining == 0)
+        {
+            wav_read_done = true;
+        }
+    }
+}
+
+// Take up to count frames from the ring, returning fewer only at the end of the file
+uint32_t wav_read_frames(audio_pcm_frame_t *frames, uint32_t count)
+{
+    if (!wav_file_open)
+    {
+        return 0;
+    }
+
+    // Check for the end before counting, so that the last buffers are counted
+    bool done = wav_read_done;
+    __dmb();
+    uint32_t head = wav_head;
+    uint32_t full = head - wav_tail;
+    uint32_t available = 0;
+    for (uint32_t i = wav_tail; i != head; i++)
+    {
+        available += wav_lengths[i % WAV_BUFFER_COUNT];
+    }
+    available -= wav_offset;
+
+    if (full < wav_min_fill)
+    {
+        wav_min_fill = full;
+    }
+    wav_fill_sum += full;
+    wav_fill_count++;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (available < wav_block_align)
+        {
+            if (done)
+            {
+                return i;
+            }
+            frames[i] = AUDIO_PCM_FRAME(AUDIO_PCM_SILENCE, AUDIO_PCM_SILENCE);
+            wav_underruns++;
+            continue;
+        }
+
+        uint16_t left = wav_next_level();
+        uint16_t right = wav_format.channels == 2 ? wav_next_level() : left;
+        frames[i] = AUDIO_PCM_FRAME(left, right);
+        available -= wav_block_align;
+    }
+    return count;
+}
+
+static uint32_t wav_pcm_callback(audio_pcm_frame_t *frames, uint32_t count, void *param)
+{
+    return wav_read_frames(frames, count);
+}
+
+
+//
+// Public interface
+//
+
+// Open a WAV file and fill the ring
+wav_error_t wav_open(const char *path, wav_format_t *format)
+{
+    wav_close();
+
+    if (fat32_open(&wav_file, path) != FAT32_OK)
+    {
+        return WAV_ERROR_FILE;
+    }
+
+    uint32_t data_size = 0;
+    wav_error_t result = wav_parse_header(&data_size);
+    if (result != WAV_OK)
+    {
+        fat32_close(&wav_file);
+        return result;
+    }
+
+    // Files written as a stream may not have their data size filled in
+    uint32_t data_start = fat32_tell(&wav_file);
+    uint32_t file_size = fat32_size(&wav_file);
+    if (data_size > file_size - data_start)
+    {
+        data_size = file_size - data_start;
+    }
+    wav_format.frames = data_size / wav_block_align;
+    wav_data_remaining = wav_format.frames * wav_block_align;
+
+    wav_head = 0;
+    wav_tail = 0;
+    wav_offset = 0;
+    wav_read_done = wav_data_remaining == 0;
+
+    wav_underruns = 0;
+    wav_reads = 0;
+    wav_bytes_read = 0;
+    wav_read_us = 0;
+    wav_max_read_us = 0;
+    wav_min_fill = WAV_BUFFER_COUNT;
+    wav_fill_sum = 0;
+    wav_fill_count = 0;
+
+    wav_file_open = true;
+    wav_service();
+
+    if (format)
+    {
+        *format = wav_format;
+    }
+    return WAV_OK;
+}
+
+// Start playing the open file, call wav_service often to keep the ring filled
+wav_error_t wav_start(void)
+{
+    if (!wav_file_open)
+    {
+        return WAV_ERROR_NOT_OPEN;
+    }
+    if (!audio_pcm_start(wav_format.sample_rate, wav_pcm_callback, NULL))
+    {
+        return WAV_ERROR_AUDIO;
+    }
+    wav_playing = true;
+    return WAV_OK;
+}
+
+// Check if the open file is playing
+bool wav_is_playing(void)
+{
+    return wav_playing && audio_pcm_is_playing();
+}
+
+// Stop playing and close the file
+void wav_close(void)
+{
+    if (wav_playing)
+    {
+        audio_pcm_stop();
+        wav_playing = false;
+    }
+    if (wav_file_open)
+    {
+        wav_file_open = false;
+        fat32_close(&wav_file);
+    }
+}
+
+// Get the telemetry of the ring since the file was opened
+void wav_get_stats(wav_stats_t *stats)
+{
+    stats->underruns = wav_underruns;
+    stats->reads = wav_reads;
+    stats->bytes_read = wav_bytes_read;
+    stats->read_us = wav_read_us;
+    stats->max_read_us = wav_max_read_us;
+    stats->min_fill = wav_fill_count > 0 ? wav_min_fill : 0;
+    stats->average_fill = wav_fill_count > 0 ? wav_fill_sum / wav_fill_count : 0;
+}
+
+const char *wav_error_string(wav_error_t error)
+{
+    switch (error)
+    {
+    case WAV_OK:
+        return "OK";
+    case WAV_ERROR_FILE:
+        return "Cannot open or read the file";
+    case WAV_ERROR_FORMAT:
+        return "Not a WAV file";
+    case WAV_ERROR_UNSUPPORTED:
+        return "Unsupported WAV format";
+    case WAV_ERROR_NOT_OPEN:
+        return "No WAV file open";
+    case WAV_ERROR_AUDIO:
+        return "Cannot start the audio";
+    default:
+        return "Unknown error";
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "pico/stdlib.h"
+#include "audio.h"
+#include "sdcard.h"
+#include "fat32.h"
+
+#define WAV_BUFFER_SIZE  (FAT32_SECTOR_SIZE) // bytes in each buffer of the read-ahead ring
+#define WAV_BUFFER_COUNT (16)                // buffers in the ring, 8K in all
+
+typedef enum
+{
+    WAV_OK = 0,
+    WAV_ERROR_FILE,        // the file could not be opened or read
+    WAV_ERROR_FORMAT,      // not a RIFF WAVE file with a format and data chunk
+    WAV_ERROR_UNSUPPORTED, // not 8 or 16-bit PCM, mono or stereo, at a rate the audio can play
+    WAV_ERROR_NOT_OPEN,    // no file is open
+    WAV_ERROR_AUDIO,       // the audio could not be started
+} wav_error_t;
+
+// Format of the open file
+typedef struct
+{
+    uint32_t sample_rate;     // frames per second
+    uint16_t channels;        // 1 (mono) or 2 (stereo)
+    uint16_t bits_per_sample; // 8 (unsigned) or 16 (signed)
+    uint32_t frames;          // frames in the data chunk
+} wav_format_t;
+
+// Telemetry of the read-ahead ring since the file was opened
+typedef struct
+{
+    uint32_t underruns;      // frames played as silence because the ring was empty
+    uint32_t reads;          // buffers read from the card
+    uint32_t bytes_read;     // bytes in them, the first read can be short
+    uint32_t read_us;        // time spent reading them
+    uint32_t max_read_us;    // longest read
+    uint8_t min_fill;        // fewest full buffers the audio found (of WAV_BUFFER_COUNT)
+    uint8_t average_fill;    // average full buffers the audio found
+} wav_stats_t;
+
+// WAV driver function prototypes
+wav_error_t wav_open(const char *path, wav_format_t *format);
+wav_error_t wav_start(void);
+void wav_service(void);
+uint32_t wav_read_frames(audio_pcm_frame_t *frames, uint32_t count);
+bool wav_is_playing(void);
+void wav_close(void);
+void wav_get_stats(wav_stats_t *stats);
+const char *wav_error_string(wav_error_t error);
@@ -68,6 +68,10 @@ int main()
 
     stdio_init_all();
     picocalc_init();
+    if (PICOCALC_RENDER_WORKER)
+    {
+        picocalc_start_render_worker(); // draw the output on core 1
+    }
     if (led_init_result == 0) {
         display_set_led_callback(set_onboard_led);
     }